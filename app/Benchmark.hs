@@ -15,6 +15,9 @@ import Client
 #endif
 
 import System.Clock
+#ifdef BENCH
+import System.Environment (getArgs)
+#endif
 
 data API =
   API { checkpwd :: Secure (String -> EnclaveDC Bool) }
@@ -61,6 +64,16 @@ timeItmsec ioa = do
   return a
 
 main :: IO ()
+#ifdef BENCH
+-- EnclaveIFC-bench: serve `checkpwd` for the loadgen `pwd` workload,
+-- over RA-TLS when started with `ra`
+main = do
+  args <- getArgs
+  let serve = if args == ["ra"] then runAppRA else runApp
+  res <- serve "client" ifctest
+  return $ res `seq` ()
+#else
 main = do
   res <- replicateM 50 $ timeItmsec $ runApp "client" ifctest -- switch to runAppRA with gatewayRA
   return $ res `seq` ()
+#endif
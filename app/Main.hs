@@ -9,18 +9,21 @@ import Data.Binary
 import Data.List (groupBy, sortBy)
 
 
-import Crypto.PubKey.RSA.PKCS15
-import Crypto.PubKey.RSA.Types (PublicKey)
 import Data.Foldable (traverse_)
 import qualified Data.ByteString as B
 
 import App
 import DCLabel
+import Memory (Footprint)
+import Seal
 #ifdef ENCLAVE
 import Enclave
 #else
 import Client
 #endif
+#ifdef REPLAY
+import System.Environment (getArgs)
+#endif
 
 
 {-@ COVID Variant and Age Correlation
@@ -69,6 +72,10 @@ import Client
     except org3, no one can decrypt this data as they dont have the private
     key. org3 can do `decrypt org3_privK result`
 
+    The result is sealed with a symmetric data key that is wrapped once
+    for org3's public key (see `Seal`), so the size of the result is not
+    bounded by the RSA modulus.
+
 
 
 @-}
@@ -115,10 +122,12 @@ instance Binary Row where
     age <- get
     return (Row var age)
 
+instance Footprint Row
+
 
 type DB     = [DCLabeled Row]
 type Result = [(CovidVariant, Age)] -- gives rounded up mean age
-type ResultEncrypted = B.ByteString
+type ResultEncrypted = Sealed
 
 database :: DB
 database = []
@@ -126,20 +135,15 @@ database = []
 sendData :: EnclaveDC (DCRef DB) -> DCLabeled Row -> EnclaveDC ()
 sendData enc_ref_db labeledRow = do
   ref_db     <- enc_ref_db
-  datas      <- readRef ref_db
-  writeRef ref_db (labeledRow : datas)
+  -- atomic, so rows pushed concurrently by org1 and org2 are all kept
+  modifyRef ref_db (labeledRow :)
 
 
-runQuery :: EnclaveDC (DCRef DB) -> PublicKey -> Priv CNF -> Priv CNF -> EnclaveDC ResultEncrypted
-runQuery enc_ref_db pubK priv1 priv2  = do
+runQuery :: EnclaveDC (DCRef DB) -> Sealer -> Priv CNF -> Priv CNF -> EnclaveDC ResultEncrypted
+runQuery enc_ref_db sealer priv1 priv2  = do
   labeled_rows <- join $ readRef <$> enc_ref_db
   rows         <- mapM (unlabelFunc priv1 priv2) labeled_rows
-  res_enc      <- liftIO $ encrypt pubK (B.toStrict $ encode $ query1 rows)
-  case res_enc of
-    Left err -> do
-      liftIO $ putStrLn (show err)
-      return B.empty
-    Right bytestr -> return bytestr
+  liftIO $ seal sealer (B.toStrict $ encode $ query1 rows)
 
 -- | Declassification
 unlabelFunc :: Priv CNF -> Priv CNF -> DCLabeled Row -> EnclaveDC Row
@@ -172,6 +176,7 @@ query1 = map collate
 data API =
   API { datasend :: Secure (DCLabeled Row -> EnclaveDC ())
       , runQ     :: Secure (EnclaveDC ResultEncrypted)
+      , datasink :: SecureSink (DCLabeled Row) -- bulk variant of datasend
       }
 
 
@@ -179,7 +184,9 @@ client1 :: API -> Client "org1" ()
 client1 api = do
   labeledDs <- mapM (clientLabel dataProvider)
                [row1, row2, row3, row4, row5, row6]
-  traverse_ (\lRow -> gatewayRA ((datasend api) <@> lRow)) labeledDs
+  -- all rows over one connection instead of one call per row
+  sent <- raStreamTo (datasink api) labeledDs
+  liftIO $ putStrLn ("org1 streamed " ++ show sent ++ " rows")
   where
     dataProvider :: DCLabel
     dataProvider = "org1" %% "org1"
@@ -198,10 +205,10 @@ client2 api = do
 client3 :: API -> Client "org3" ()
 client3 api = do
   res_enc <- gatewayRA (runQ api)
-  privK   <- liftIO $ read <$> readFile "ssl/private.key"
-  res     <- liftIO $ decryptSafer privK res_enc
+  opener  <- liftIO $ loadOpener "ssl/private.key"
+  res     <- liftIO $ unseal opener res_enc
   case res of
-    Left err -> liftIO $ putStrLn $ show err
+    Left err -> liftIO $ putStrLn err
     Right bytestr -> do
       let result = decode (B.fromStrict bytestr) :: Result
       liftIO $ putStrLn "Analytics result"
@@ -244,14 +251,16 @@ org3 = "org3"
 
 ifctest :: App Done
 ifctest = do
-  db <- liftNewRef dcPublic database -- db kept permissive because all
-                                     -- data is labeled
+  db <- liftNewRefSized "db" dcPublic database -- db kept permissive because
+                                               -- all data is labeled
   sfunc    <- inEnclave initState $ sendData db
   pubK     <- liftIO $ read <$> readFile "ssl/public.key"
+  sealer   <- liftIO $ newSealer pubK
   org1Priv <- liftIO $ privInit (toCNF org1)
   org2Priv <- liftIO $ privInit (toCNF org2)
-  qfunc    <- inEnclave initState $ runQuery db pubK org1Priv org2Priv
-  let api = API sfunc qfunc
+  qfunc    <- inEnclave initState $ runQuery db sealer org1Priv org2Priv
+  sink     <- inEnclaveSink initState $ sendData db
+  let api = API sfunc qfunc sink
   runClient (client1 api)
   runClient (client2 api)
   runClient (client3 api)
@@ -259,6 +268,18 @@ ifctest = do
     initState = dcDefaultState cTrue
 
 main :: IO ()
+#ifdef REPLAY
+-- EnclaveIFC-replay <key> <trace>: run a captured trace against `ifctest`,
+-- opening it with the operator's private key
+main = do
+  args <- getArgs
+  case args of
+    [key, trace] -> do
+      res <- replayApp key trace org3 ifctest
+      return $ res `seq` ()
+    _ -> putStrLn "usage: EnclaveIFC-replay <private key> <trace>"
+#else
 main = do
   res <- runAppRA org3 ifctest
   return $ res `seq` ()
+#endif
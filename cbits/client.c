@@ -16,6 +16,7 @@
 #include <ctype.h>
 #include <dlfcn.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -131,62 +132,57 @@ static bool getenv_client_inside_sgx() {
 
 
 
-// NOTE: strcmp returns 0 when strings are equal
-
-int setup_ra_tls_send(char *data, size_t length, char *epidordcap, char* response) {
+#define MAX_RESPONSE_SIZE (64 * 1024 * 1024) /* bytes, excluding the 8-byte header */
 
-    int final_data_length = sizeof(size_t) + length; //XXX: for now this <= 1024
-    char len_prefixed_data[final_data_length];
-
-    int ret;
-    size_t len;
-    int exit_code = MBEDTLS_EXIT_FAILURE;
+/*
+ * One RA-TLS connection to the enclave. The handshake and attestation
+ * happen once in ra_tls_session_open; afterwards any number of
+ * length-prefixed requests can be exchanged with ra_tls_session_call
+ * (the server keeps the connection open), which is what streaming
+ * calls rely on.
+ */
+struct ra_tls_session {
     mbedtls_net_context server_fd;
-    uint32_t flags;
-    unsigned char buf[1024]; // for now fixing the size at 1024 bytes
-    const char* pers = "ssl_client1";
-    bool in_sgx = getenv_client_inside_sgx();
-
-    char* error;
-    void* ra_tls_verify_lib           = NULL;
-    ra_tls_verify_callback_der_f      = NULL;
-    ra_tls_set_measurement_callback_f = NULL;
-
     mbedtls_entropy_context entropy;
     mbedtls_ctr_drbg_context ctr_drbg;
     mbedtls_ssl_context ssl;
     mbedtls_ssl_config conf;
     mbedtls_x509_crt cacert;
+};
 
-#if defined(MBEDTLS_DEBUG_C)
-    mbedtls_debug_set_threshold(DEBUG_LEVEL);
-#endif
+static void session_free(struct ra_tls_session* s) {
+    mbedtls_net_free(&s->server_fd);
 
-    // ABHI: Initialize the RNG and the session data
-    // Takes the branch if (!strcmp(argv[1], "epid"))
+    mbedtls_x509_crt_free(&s->cacert);
+    mbedtls_ssl_free(&s->ssl);
+    mbedtls_ssl_config_free(&s->conf);
+    mbedtls_ctr_drbg_free(&s->ctr_drbg);
+    mbedtls_entropy_free(&s->entropy);
+    free(s);
+}
 
-    mbedtls_net_init(&server_fd);
-    mbedtls_ssl_init(&ssl);
-    mbedtls_ssl_config_init(&conf);
-    mbedtls_ctr_drbg_init(&ctr_drbg);
-    mbedtls_x509_crt_init(&cacert);
-    mbedtls_entropy_init(&entropy);
+/*
+ * The RA-TLS verification library and the two callbacks above are process-wide: they are loaded
+ * by the first session and shared by all later ones, which may be opened from several Haskell
+ * threads at once. Every session must ask for the same kind of verification.
+ */
+static pthread_mutex_t g_verify_lock = PTHREAD_MUTEX_INITIALIZER;
+static int g_verify_state; /* 0: not loaded yet, 1: loaded, -1: loading failed */
+static char g_verify_mode[32];
+static void* g_verify_lib;
 
-    /* if (argc < 2 || */
-    /*     (strcmp(argv[1], "native") && strcmp(argv[1], "epid") && strcmp(argv[1], "dcap"))) { */
-    /*     mbedtls_printf("USAGE: %s native|epid|dcap [SGX measurements]\n", argv[0]); */
-    /*     return 1; */
-    /* } */
+static int load_verify_lib(const char* epidordcap, bool in_sgx) {
+    char* error;
 
     if (!strcmp(epidordcap, "epid")) {
-        ra_tls_verify_lib = dlopen("libra_tls_verify_epid.so", RTLD_LAZY);
-        if (!ra_tls_verify_lib) {
+        g_verify_lib = dlopen("libra_tls_verify_epid.so", RTLD_LAZY);
+        if (!g_verify_lib) {
             mbedtls_printf("%s\n", dlerror());
             mbedtls_printf("User requested RA-TLS verification with EPID but cannot find lib\n");
             if (in_sgx) {
                 mbedtls_printf("Please make sure that you are using client_epid.manifest\n");
             }
-            return 1;
+            return -1;
         }
     } else if (!strcmp(epidordcap, "dcap")) {
         if (in_sgx) {
@@ -194,12 +190,12 @@ int setup_ra_tls_send(char *data, size_t length, char *epidordcap, char* respons
              * RA-TLS verification with DCAP inside SGX enclave uses dummies instead of real
              * functions from libsgx_urts.so, thus we don't need to load this helper library.
              */
-            ra_tls_verify_lib = dlopen("libra_tls_verify_dcap_gramine.so", RTLD_LAZY);
-            if (!ra_tls_verify_lib) {
+            g_verify_lib = dlopen("libra_tls_verify_dcap_gramine.so", RTLD_LAZY);
+            if (!g_verify_lib) {
                 mbedtls_printf("%s\n", dlerror());
                 mbedtls_printf("User requested RA-TLS verification with DCAP inside SGX but cannot find lib\n");
                 mbedtls_printf("Please make sure that you are using client_dcap.manifest\n");
-                return 1;
+                return -1;
             }
         } else {
             void* helper_sgx_urts_lib = dlopen("libsgx_urts.so", RTLD_NOW | RTLD_GLOBAL);
@@ -207,98 +203,86 @@ int setup_ra_tls_send(char *data, size_t length, char *epidordcap, char* respons
                 mbedtls_printf("%s\n", dlerror());
                 mbedtls_printf("User requested RA-TLS verification with DCAP but cannot find helper"
                                " libsgx_urts.so lib\n");
-                return 1;
+                return -1;
             }
 
-            ra_tls_verify_lib = dlopen("libra_tls_verify_dcap.so", RTLD_LAZY);
-            if (!ra_tls_verify_lib) {
+            g_verify_lib = dlopen("libra_tls_verify_dcap.so", RTLD_LAZY);
+            if (!g_verify_lib) {
                 mbedtls_printf("%s\n", dlerror());
                 mbedtls_printf("User requested RA-TLS verification with DCAP but cannot find lib\n");
-                return 1;
+                return -1;
             }
         }
     }
 
-    // ABHI: Populating the ra_tls_verify_callback_der_f, ra_tls_set_measurement_callback_f
-    if (ra_tls_verify_lib) {
-        ra_tls_verify_callback_der_f = dlsym(ra_tls_verify_lib, "ra_tls_verify_callback_der");
+    if (g_verify_lib) {
+        ra_tls_verify_callback_der_f = dlsym(g_verify_lib, "ra_tls_verify_callback_der");
         if ((error = dlerror()) != NULL) {
             mbedtls_printf("%s\n", error);
-            return 1;
+            return -1;
         }
 
-        ra_tls_set_measurement_callback_f = dlsym(ra_tls_verify_lib, "ra_tls_set_measurement_callback");
+        ra_tls_set_measurement_callback_f = dlsym(g_verify_lib, "ra_tls_set_measurement_callback");
         if ((error = dlerror()) != NULL) {
             mbedtls_printf("%s\n", error);
-            return 1;
+            return -1;
         }
+
+        (*ra_tls_set_measurement_callback_f)(NULL); /* just to test RA-TLS code */
+    }
+    return 0;
+}
+
+/* Loads the verification library once. Returns 0 if `epidordcap` matches what was loaded. */
+static int verify_lib_once(const char* epidordcap, bool in_sgx) {
+    int ret;
+
+    pthread_mutex_lock(&g_verify_lock);
+    if (g_verify_state == 0) {
+        snprintf(g_verify_mode, sizeof(g_verify_mode), "%s", epidordcap);
+        g_verify_state = load_verify_lib(epidordcap, in_sgx) == 0 ? 1 : -1;
+    }
+    if (g_verify_state == 1 && strcmp(g_verify_mode, epidordcap) != 0) {
+        mbedtls_printf("RA-TLS verification with %s requested, but %s is already in use\n",
+                       epidordcap, g_verify_mode);
+        ret = -1;
+    } else {
+        ret = g_verify_state == 1 ? 0 : -1;
     }
+    pthread_mutex_unlock(&g_verify_lock);
+    return ret;
+}
+
+// NOTE: strcmp returns 0 when strings are equal
 
-    /* if (argc > 2 && ra_tls_verify_lib) { // this branch not taken */
-    /*     if (argc != 6) { */
-    /*         mbedtls_printf("USAGE: %s %s <expected mrenclave> <expected mrsigner>" */
-    /*                        " <expected isv_prod_id> <expected isv_svn>\n" */
-    /*                        "       (first two in hex, last two as decimal; set to 0 to ignore)\n", */
-    /*                        argv[0], argv[1]); */
-    /*         return 1; */
-    /*     } */
-
-    /*     mbedtls_printf("[ using our own SGX-measurement verification callback" */
-    /*                    " (via command line options) ]\n"); */
-
-    /*     g_verify_mrenclave   = true; */
-    /*     g_verify_mrsigner    = true; */
-    /*     g_verify_isv_prod_id = true; */
-    /*     g_verify_isv_svn     = true; */
-
-    /*     (*ra_tls_set_measurement_callback_f)(my_verify_measurements); */
-
-    /*     if (!strcmp(argv[2], "0")) { */
-    /*         mbedtls_printf("  - ignoring MRENCLAVE\n"); */
-    /*         g_verify_mrenclave = false; */
-    /*     } else if (parse_hex(argv[2], g_expected_mrenclave, sizeof(g_expected_mrenclave)) < 0) { */
-    /*         mbedtls_printf("Cannot parse MRENCLAVE!\n"); */
-    /*         return 1; */
-    /*     } */
-
-    /*     if (!strcmp(argv[3], "0")) { */
-    /*         mbedtls_printf("  - ignoring MRSIGNER\n"); */
-    /*         g_verify_mrsigner = false; */
-    /*     } else if (parse_hex(argv[3], g_expected_mrsigner, sizeof(g_expected_mrsigner)) < 0) { */
-    /*         mbedtls_printf("Cannot parse MRSIGNER!\n"); */
-    /*         return 1; */
-    /*     } */
-
-    /*     if (!strcmp(argv[4], "0")) { */
-    /*         mbedtls_printf("  - ignoring ISV_PROD_ID\n"); */
-    /*         g_verify_isv_prod_id = false; */
-    /*     } else { */
-    /*         errno = 0; */
-    /*         uint16_t isv_prod_id = (uint16_t)strtoul(argv[4], NULL, 10); */
-    /*         if (errno) { */
-    /*             mbedtls_printf("Cannot parse ISV_PROD_ID!\n"); */
-    /*             return 1; */
-    /*         } */
-    /*         memcpy(g_expected_isv_prod_id, &isv_prod_id, sizeof(isv_prod_id)); */
-    /*     } */
-
-    /*     if (!strcmp(argv[5], "0")) { */
-    /*         mbedtls_printf("  - ignoring ISV_SVN\n"); */
-    /*         g_verify_isv_svn = false; */
-    /*     } else { */
-    /*         errno = 0; */
-    /*         uint16_t isv_svn = (uint16_t)strtoul(argv[5], NULL, 10); */
-    /*         if (errno) { */
-    /*             mbedtls_printf("Cannot parse ISV_SVN\n"); */
-    /*             return 1; */
-    /*         } */
-    /*         memcpy(g_expected_isv_svn, &isv_svn, sizeof(isv_svn)); */
-    /*     } */
-    /* } */
-    if (ra_tls_verify_lib) { // this branch taken
+/* Connect, handshake and verify the enclave. Returns NULL on failure. */
+void* ra_tls_session_open(const char* epidordcap) {
+    int ret = 0;
+    uint32_t flags;
+    const char* pers = "ssl_client1";
+    bool in_sgx = getenv_client_inside_sgx();
+
+    struct ra_tls_session* s = calloc(1, sizeof(*s));
+    if (!s)
+        return NULL;
+
+#if defined(MBEDTLS_DEBUG_C)
+    mbedtls_debug_set_threshold(DEBUG_LEVEL);
+#endif
+
+    mbedtls_net_init(&s->server_fd);
+    mbedtls_ssl_init(&s->ssl);
+    mbedtls_ssl_config_init(&s->conf);
+    mbedtls_ctr_drbg_init(&s->ctr_drbg);
+    mbedtls_x509_crt_init(&s->cacert);
+    mbedtls_entropy_init(&s->entropy);
+
+    if (verify_lib_once(epidordcap, in_sgx) != 0)
+        goto fail;
+
+    if (g_verify_lib) {
         mbedtls_printf("[ using default SGX-measurement verification callback"
                        " (via RA_TLS_* environment variables) ]\n");
-        (*ra_tls_set_measurement_callback_f)(NULL); /* just to test RA-TLS code */
     } else {
         mbedtls_printf("[ using normal TLS flows ]\n");
     }
@@ -306,101 +290,90 @@ int setup_ra_tls_send(char *data, size_t length, char *epidordcap, char* respons
     mbedtls_printf("\n  . Seeding the random number generator...");
     fflush(stdout);
 
-    ret = mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy,
+    ret = mbedtls_ctr_drbg_seed(&s->ctr_drbg, mbedtls_entropy_func, &s->entropy,
                                 (const unsigned char*)pers, strlen(pers));
     if (ret != 0) {
         mbedtls_printf(" failed\n  ! mbedtls_ctr_drbg_seed returned %d\n", ret);
-        goto exit;
+        goto fail;
     }
 
     mbedtls_printf(" ok\n");
 
-    // ABHI: Start the connection
-
     mbedtls_printf("  . Connecting to tcp/%s/%s...", SERVER_NAME, SERVER_PORT);
     fflush(stdout);
 
-    ret = mbedtls_net_connect(&server_fd, SERVER_NAME, SERVER_PORT, MBEDTLS_NET_PROTO_TCP);
+    ret = mbedtls_net_connect(&s->server_fd, SERVER_NAME, SERVER_PORT, MBEDTLS_NET_PROTO_TCP);
     if (ret != 0) {
         mbedtls_printf(" failed\n  ! mbedtls_net_connect returned %d\n\n", ret);
-        goto exit;
+        goto fail;
     }
 
     mbedtls_printf(" ok\n");
 
-    // ABHI: Setup stuff
-
     mbedtls_printf("  . Setting up the SSL/TLS structure...");
     fflush(stdout);
 
-    ret = mbedtls_ssl_config_defaults(&conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM,
-                                      MBEDTLS_SSL_PRESET_DEFAULT);
+    ret = mbedtls_ssl_config_defaults(&s->conf, MBEDTLS_SSL_IS_CLIENT,
+                                      MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
     if (ret != 0) {
         mbedtls_printf(" failed\n  ! mbedtls_ssl_config_defaults returned %d\n\n", ret);
-        goto exit;
+        goto fail;
     }
 
     mbedtls_printf(" ok\n");
 
-    // ABHI: Initializing the loading the CA root certificate
-
     mbedtls_printf("  . Loading the CA root certificate ...");
     fflush(stdout);
 
-    ret = mbedtls_x509_crt_parse_file(&cacert, CA_CRT_PATH);
+    ret = mbedtls_x509_crt_parse_file(&s->cacert, CA_CRT_PATH);
     if (ret < 0) {
         mbedtls_printf( " failed\n  !  mbedtls_x509_crt_parse_file returned -0x%x\n\n", -ret );
-        goto exit;
+        goto fail;
     }
 
-    mbedtls_ssl_conf_authmode(&conf, MBEDTLS_SSL_VERIFY_OPTIONAL);
-    mbedtls_ssl_conf_ca_chain(&conf, &cacert, NULL);
+    mbedtls_ssl_conf_authmode(&s->conf, MBEDTLS_SSL_VERIFY_OPTIONAL);
+    mbedtls_ssl_conf_ca_chain(&s->conf, &s->cacert, NULL);
     mbedtls_printf(" ok\n");
 
-    // XXX: ABHI: IMP installing verification callback here
-    if (ra_tls_verify_lib) {
+    if (g_verify_lib) {
         /* use RA-TLS verification callback; this will overwrite CA chain set up above */
         mbedtls_printf("  . Installing RA-TLS callback ...");
-        mbedtls_ssl_conf_verify(&conf, &my_verify_callback, NULL);
+        mbedtls_ssl_conf_verify(&s->conf, &my_verify_callback, NULL);
         mbedtls_printf(" ok\n");
     }
 
-    mbedtls_ssl_conf_rng(&conf, mbedtls_ctr_drbg_random, &ctr_drbg);
-    mbedtls_ssl_conf_dbg(&conf, my_debug, stdout);
+    mbedtls_ssl_conf_rng(&s->conf, mbedtls_ctr_drbg_random, &s->ctr_drbg);
+    mbedtls_ssl_conf_dbg(&s->conf, my_debug, stdout);
 
-    ret = mbedtls_ssl_setup(&ssl, &conf);
+    ret = mbedtls_ssl_setup(&s->ssl, &s->conf);
     if (ret != 0) {
         mbedtls_printf(" failed\n  ! mbedtls_ssl_setup returned %d\n\n", ret);
-        goto exit;
+        goto fail;
     }
 
-    ret = mbedtls_ssl_set_hostname(&ssl, SERVER_NAME);
+    ret = mbedtls_ssl_set_hostname(&s->ssl, SERVER_NAME);
     if (ret != 0) {
         mbedtls_printf(" failed\n  ! mbedtls_ssl_set_hostname returned %d\n\n", ret);
-        goto exit;
+        goto fail;
     }
 
-    mbedtls_ssl_set_bio(&ssl, &server_fd, mbedtls_net_send, mbedtls_net_recv, NULL);
-
-    // ABHI : Handshake
+    mbedtls_ssl_set_bio(&s->ssl, &s->server_fd, mbedtls_net_send, mbedtls_net_recv, NULL);
 
     mbedtls_printf("  . Performing the SSL/TLS handshake...");
     fflush(stdout);
 
-    while ((ret = mbedtls_ssl_handshake(&ssl)) != 0) {
+    while ((ret = mbedtls_ssl_handshake(&s->ssl)) != 0) {
         if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
             mbedtls_printf(" failed\n  ! mbedtls_ssl_handshake returned -0x%x\n\n", -ret);
-            goto exit;
+            goto fail;
         }
     }
 
     mbedtls_printf(" ok\n");
 
-    // ABHI: Server certificate verification
-
     mbedtls_printf("  . Verifying peer X.509 certificate...");
 
-    flags = mbedtls_ssl_get_verify_result(&ssl);
+    flags = mbedtls_ssl_get_verify_result(&s->ssl);
     if (flags != 0) {
         char vrfy_buf[512];
         mbedtls_printf(" failed\n");
@@ -408,98 +381,109 @@ int setup_ra_tls_send(char *data, size_t length, char *epidordcap, char* respons
         mbedtls_printf("%s\n", vrfy_buf);
 
         /* verification failed for whatever reason, fail loudly */
-        goto exit;
-    } else {
-        mbedtls_printf(" ok\n");
+        goto fail;
     }
 
-    // ABHI: Write the GET request
-
-    mbedtls_printf("  > Write to server:");
-    fflush(stdout);
+    mbedtls_printf(" ok\n");
+    return s;
 
-    //len = sprintf((char*)buf, GET_REQUEST); // XXX: ABHI: This is where we send the data
-    // invariant- sizeof(len_prefixed_data) = sizeof(size_t) + sizeof(data) or length
-    //memcpy(len_prefixed_data, &length, sizeof(size_t));
-    size_t data_len = length;
-    for (int i = 7; i >= 0; i--) {
-      len_prefixed_data[i] = (char)(data_len & 0xFF);
-      data_len >>= sizeof(size_t);
+fail:
+#ifdef MBEDTLS_ERROR_C
+    if (ret != 0) {
+        char error_buf[100];
+        mbedtls_strerror(ret, error_buf, sizeof(error_buf));
+        mbedtls_printf("Last error was: %d - %s\n\n", ret, error_buf);
     }
+#endif
+    session_free(s);
+    return NULL;
+}
 
-
-    memcpy(len_prefixed_data + sizeof(size_t), data, length);
-
-
-    /* if(final_data_length > sizeof(buf)) // bound check */
-    /*   return 1; */
-    memcpy((char*)buf, len_prefixed_data, final_data_length);
-    len = final_data_length;
-
-
-
-    while ((ret = mbedtls_ssl_write(&ssl, buf, len)) <= 0) {
-        if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
-            mbedtls_printf(" failed\n  ! mbedtls_ssl_write returned %d\n\n", ret);
-            goto exit;
-        }
+static int ssl_write_all(mbedtls_ssl_context* ssl, const unsigned char* buf, size_t len) {
+    while (len > 0) {
+        int ret = mbedtls_ssl_write(ssl, buf, len);
+        if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE)
+            continue;
+        if (ret <= 0)
+            return ret == 0 ? MBEDTLS_ERR_SSL_CONN_EOF : ret;
+        buf += ret;
+        len -= ret;
     }
+    return 0;
+}
 
-    len = ret;
-    mbedtls_printf(" %lu bytes written\n\n%s", len, (char*)buf);
-
-    mbedtls_printf("  < Read from server:");
-    fflush(stdout);
-
-    do {
-        len = sizeof(buf) - 1;
-        memset(buf, 0, sizeof(buf));
-        ret = mbedtls_ssl_read(&ssl, buf, len);
-
+static int ssl_read_all(mbedtls_ssl_context* ssl, unsigned char* buf, size_t len) {
+    while (len > 0) {
+        int ret = mbedtls_ssl_read(ssl, buf, len);
         if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE)
             continue;
+        if (ret <= 0)
+            return ret == 0 ? MBEDTLS_ERR_SSL_CONN_EOF : ret;
+        buf += ret;
+        len -= ret;
+    }
+    return 0;
+}
 
-        if (ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY)
-            break;
-
-        if (ret < 0) {
-            mbedtls_printf("failed\n  ! mbedtls_ssl_read returned %d\n\n", ret);
-            break;
-        }
+/*
+ * Send one request and wait for its response. Both travel with an
+ * 8-byte big-endian length prefix (see createPayload on the Haskell
+ * side); the prefix is added here and stripped from the response, which
+ * is malloc'ed and handed to the caller. Returns 0 on success.
+ */
+int ra_tls_session_call(void* handle, const char* data, size_t length, char** response,
+                        size_t* response_len) {
+    struct ra_tls_session* s = handle;
+    unsigned char hdr[8];
+    unsigned char* body = NULL;
+    size_t len = length;
+    int ret;
 
-        if (ret == 0) {
-            mbedtls_printf("\n\nEOF\n\n");
-            break;
-        }
+    for (int i = 7; i >= 0; i--) {
+        hdr[i] = (unsigned char)(len & 0xFF);
+        len >>= 8;
+    }
 
-        len = ret;
-        mbedtls_printf(" %lu bytes read\n\n%s", len, (char*)buf);
-        memcpy(response, buf, 1024);// length of both arrays static at 1024
-    } while (1);
+    ret = ssl_write_all(&s->ssl, hdr, sizeof(hdr));
+    if (ret == 0)
+        ret = ssl_write_all(&s->ssl, (const unsigned char*)data, length);
+    if (ret == 0)
+        ret = ssl_read_all(&s->ssl, hdr, sizeof(hdr));
+    if (ret != 0)
+        goto fail;
+
+    len = 0;
+    for (size_t i = 0; i < sizeof(hdr); i++)
+        len = (len << 8) | hdr[i];
+    if (len > MAX_RESPONSE_SIZE) {
+        ret = MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
+        goto fail;
+    }
 
-    mbedtls_ssl_close_notify(&ssl);
-    exit_code = MBEDTLS_EXIT_SUCCESS;
-exit:
-#ifdef MBEDTLS_ERROR_C
-    if (exit_code != MBEDTLS_EXIT_SUCCESS) {
-        char error_buf[100];
-        mbedtls_strerror(ret, error_buf, sizeof(error_buf));
-        mbedtls_printf("Last error was: %d - %s\n\n", ret, error_buf);
+    body = malloc(len ? len : 1);
+    if (!body) {
+        ret = MBEDTLS_ERR_SSL_ALLOC_FAILED;
+        goto fail;
     }
-#endif
+    ret = ssl_read_all(&s->ssl, body, len);
+    if (ret != 0)
+        goto fail;
 
-    if (ra_tls_verify_lib)
-        dlclose(ra_tls_verify_lib);
+    *response = (char*)body;
+    *response_len = len;
+    return 0;
 
-    mbedtls_net_free(&server_fd);
+fail:
+    free(body);
+    mbedtls_printf("  ! ra_tls_session_call failed with -0x%x\n", -ret);
+    return 1;
+}
 
-    mbedtls_x509_crt_free(&cacert);
-    mbedtls_ssl_free(&ssl);
-    mbedtls_ssl_config_free(&conf);
-    mbedtls_ctr_drbg_free(&ctr_drbg);
-    mbedtls_entropy_free(&entropy);
+void ra_tls_session_close(void* handle) {
+    struct ra_tls_session* s = handle;
 
-    return exit_code;
+    mbedtls_ssl_close_notify(&s->ssl);
+    session_free(s);
 }
 
 /*
@@ -0,0 +1,209 @@
+/*
+ * LZ4 block compression for the message envelopes of src/Compress.hs.
+ *
+ * Reads and writes the plain LZ4 block format (no frame header or checksum: the envelope carries
+ * the original length and TLS authenticates the bytes). The compressor is the simple greedy one:
+ * a single hash table of 4-byte sequences, no backward extension of matches.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define MIN_MATCH     4
+#define HASH_LOG      12
+#define LAST_LITERALS 5     /* the last 5 bytes of a block are always literals */
+#define MF_LIMIT      12    /* the last match starts at least 12 bytes before the end */
+#define MAX_DISTANCE  65535
+
+static uint32_t read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t hash4(uint32_t seq) {
+    return (seq * 2654435761u) >> (32 - HASH_LOG);
+}
+
+/* Writes the extra bytes of a literal or match length that did not fit in its 4-bit field. */
+static uint8_t* put_length(uint8_t* op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+/* Worst case output for a sequence of `lit` literals and a match of `mlen` (minus MIN_MATCH). */
+static size_t sequence_bound(size_t lit, size_t mlen) {
+    return 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1;
+}
+
+size_t lz4_compress_bound(size_t n) {
+    return n + n / 255 + 16;
+}
+
+/* CPU time of the calling thread, 0 if unavailable. */
+static uint64_t thread_cpu_ns(void) {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+        return 0;
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* Both ends of a measurement must be taken on the same OS thread, hence inside one C call: a
+ * Haskell thread may move between OS threads from one foreign call to the next. */
+static uint64_t elapsed_ns(uint64_t start) {
+    uint64_t end = thread_cpu_ns();
+    return end > start ? end - start : 0;
+}
+
+static size_t compress_block(const uint8_t* src, size_t n, uint8_t* dst, size_t dst_cap) {
+    uint32_t table[1 << HASH_LOG];
+    const uint8_t* ip     = src;
+    const uint8_t* anchor = src;
+    const uint8_t* end    = src + n;
+    uint8_t* op           = dst;
+    uint8_t* oend         = dst + dst_cap;
+
+    if (n > MF_LIMIT) {
+        const uint8_t* mflimit     = end - MF_LIMIT;
+        const uint8_t* match_limit = end - LAST_LITERALS;
+
+        memset(table, 0, sizeof(table));
+        ip++;
+        while (ip <= mflimit) {
+            uint32_t seq = read32(ip);
+            uint32_t h   = hash4(seq);
+            const uint8_t* ref = src + table[h];
+            table[h] = (uint32_t)(ip - src);
+
+            if (ip - ref > MAX_DISTANCE || read32(ref) != seq) {
+                ip++;
+                continue;
+            }
+
+            const uint8_t* mp = ip + MIN_MATCH;
+            const uint8_t* rp = ref + MIN_MATCH;
+            while (mp < match_limit && *mp == *rp) {
+                mp++;
+                rp++;
+            }
+
+            size_t lit  = (size_t)(ip - anchor);
+            size_t mlen = (size_t)(mp - ip) - MIN_MATCH;
+            if (sequence_bound(lit, mlen) > (size_t)(oend - op))
+                return 0;
+
+            uint8_t* token = op++;
+            *token = (uint8_t)((lit >= 15 ? 15 : lit) << 4);
+            if (lit >= 15)
+                op = put_length(op, lit - 15);
+            memcpy(op, anchor, lit);
+            op += lit;
+
+            size_t offset = (size_t)(ip - ref);
+            *op++ = (uint8_t)(offset & 0xFF);
+            *op++ = (uint8_t)(offset >> 8);
+
+            *token |= (uint8_t)(mlen >= 15 ? 15 : mlen);
+            if (mlen >= 15)
+                op = put_length(op, mlen - 15);
+
+            ip     = mp;
+            anchor = ip;
+        }
+    }
+
+    size_t lit = (size_t)(end - anchor);
+    if (sequence_bound(lit, 0) > (size_t)(oend - op))
+        return 0;
+    *op++ = (uint8_t)((lit >= 15 ? 15 : lit) << 4);
+    if (lit >= 15)
+        op = put_length(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+    return (size_t)(op - dst);
+}
+
+/* Reads a length extension. Returns -1 if the input ends first. */
+static int get_length(const uint8_t** ip, const uint8_t* iend, size_t* len) {
+    uint8_t b;
+    do {
+        if (*ip >= iend)
+            return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+/* Compresses `n` bytes at `src` into `dst`. Returns the compressed size, or 0 if it does not fit
+ * in `dst_cap` bytes; a `dst_cap` of lz4_compress_bound(n) is always enough. The CPU time taken
+ * goes to `*cpu_ns`. */
+size_t lz4_compress(const uint8_t* src, size_t n, uint8_t* dst, size_t dst_cap, uint64_t* cpu_ns) {
+    uint64_t start = thread_cpu_ns();
+    size_t ret = compress_block(src, n, dst, dst_cap);
+    *cpu_ns = elapsed_ns(start);
+    return ret;
+}
+
+static long decompress_block(const uint8_t* src, size_t n, uint8_t* dst, size_t dst_len) {
+    const uint8_t* ip   = src;
+    const uint8_t* iend = src + n;
+    uint8_t* op         = dst;
+    uint8_t* oend       = dst + dst_len;
+
+    for (;;) {
+        if (ip >= iend)
+            return -1;
+        unsigned token = *ip++;
+
+        size_t lit = token >> 4;
+        if (lit == 15 && get_length(&ip, iend, &lit) != 0)
+            return -1;
+        if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op))
+            return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+
+        if (ip == iend)
+            break; /* the last sequence has no match */
+
+        if (iend - ip < 2)
+            return -1;
+        size_t offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst))
+            return -1;
+
+        size_t mlen = token & 15;
+        if (mlen == 15 && get_length(&ip, iend, &mlen) != 0)
+            return -1;
+        mlen += MIN_MATCH;
+        if (mlen > (size_t)(oend - op))
+            return -1;
+
+        /* byte by byte: the match may overlap the bytes it produces */
+        const uint8_t* ref = op - offset;
+        for (size_t i = 0; i < mlen; i++)
+            op[i] = ref[i];
+        op += mlen;
+    }
+
+    return op == oend ? (long)dst_len : -1;
+}
+
+/* Decompresses `n` bytes at `src`, which must expand to exactly `dst_len` bytes at `dst`.
+ * Returns `dst_len`, or -1 if the input is malformed; never reads or writes out of bounds. The
+ * CPU time taken goes to `*cpu_ns`. */
+long lz4_decompress(const uint8_t* src, size_t n, uint8_t* dst, size_t dst_len, uint64_t* cpu_ns) {
+    uint64_t start = thread_cpu_ns();
+    long ret = decompress_block(src, n, dst, dst_len);
+    *cpu_ns = elapsed_ns(start);
+    return ret;
+}
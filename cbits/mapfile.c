@@ -0,0 +1,39 @@
+/*
+ * Read-only file mappings for the memory-mapped constants of src/Mapped.hs.
+ */
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Maps the whole file at `path` read-only. Returns NULL and sets *len to 0 if the file cannot be
+ * opened or mapped or is empty. The descriptor is closed right away; the mapping stays valid. */
+uint8_t* map_file(const char* path, size_t* len) {
+    struct stat st;
+    void* addr;
+
+    *len = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return NULL;
+    }
+
+    addr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+        return NULL;
+
+    *len = (size_t)st.st_size;
+    return addr;
+}
+
+void unmap_file(uint8_t* addr, size_t len) {
+    munmap(addr, len);
+}
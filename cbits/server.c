@@ -13,12 +13,19 @@
 #define _GNU_SOURCE
 #include "mbedtls/build_info.h"
 
+#include <arpa/inet.h>
 #include <assert.h>
 #include <dlfcn.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
 #define mbedtls_fprintf fprintf
@@ -49,6 +56,14 @@ int (*ra_tls_create_key_and_crt_der_f)(uint8_t** der_key, size_t* der_key_size,
 #define SRV_CRT_PATH "ssl/server.crt"
 #define SRV_KEY_PATH "ssl/server.key"
 
+#define MAX_REQUEST_SIZE (64 * 1024 * 1024) /* bytes, excluding the 8-byte header */
+#define IDLE_TIMEOUT_SEC 30                 /* handshake and read stalls */
+#define ACCEPT_RETRY_SEC 1                  /* pause after a failed accept */
+#define EPOLL_BATCH      64
+
+#define LISTEN_TAG UINT64_MAX
+#define WAKE_TAG   (UINT64_MAX - 1)
+
 static void my_debug(void* ctx, int level, const char* file, int line, const char* str) {
     ((void)level);
 
@@ -75,12 +90,364 @@ static ssize_t file_read(const char* path, char* buf, size_t count) {
     return bytes;
 }
 
-int startServer(int *flag, char *data) {
-    int ret;
+/*
+ * Requests travel to Haskell and responses back through two queues.
+ * server_next_request() blocks a Haskell thread until some connection has
+ * read a complete request; server_post_response() queues the reply and wakes
+ * the event loop through a pipe. A connection id is (generation << 32 | slot)
+ * so a reply for a connection that has since been closed and reused is
+ * dropped instead of being written to the wrong peer. Epoll events carry the
+ * id too: a connection closed earlier in the same epoll_wait batch leaves
+ * events behind that must not drive the slot's next occupant.
+ */
+struct msg {
+    uint64_t conn_id;
+    char peer[INET6_ADDRSTRLEN]; /* requests only: numeric address of the client */
+    unsigned char* data;
     size_t len;
-    mbedtls_net_context listen_fd;
-    mbedtls_net_context client_fd;
-    unsigned char buf[1024];
+    struct msg* next;
+};
+
+struct msg_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t nonempty;
+    struct msg* head;
+    struct msg* tail;
+};
+
+static struct msg_queue g_requests  = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                                       NULL, NULL};
+static struct msg_queue g_responses = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                                       NULL, NULL};
+static int g_wake_fds[2] = {-1, -1};
+
+static int msg_push(struct msg_queue* q, uint64_t conn_id, const char* peer, unsigned char* data,
+                    size_t len) {
+    struct msg* m = malloc(sizeof(*m));
+    if (!m)
+        return -1;
+    m->conn_id = conn_id;
+    snprintf(m->peer, sizeof(m->peer), "%s", peer ? peer : "");
+    m->data = data;
+    m->len = len;
+    m->next = NULL;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->tail)
+        q->tail->next = m;
+    else
+        q->head = m;
+    q->tail = m;
+    pthread_cond_signal(&q->nonempty);
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+/* detach the whole queue; the caller walks and frees the list */
+static struct msg* msg_take_all(struct msg_queue* q) {
+    pthread_mutex_lock(&q->lock);
+    struct msg* m = q->head;
+    q->head = q->tail = NULL;
+    pthread_mutex_unlock(&q->lock);
+    return m;
+}
+
+/* Called from Haskell; blocks. Ownership of *data passes to the caller. `peer` receives the
+ * client's numeric address and must hold INET6_ADDRSTRLEN bytes. */
+int server_next_request(uint64_t* conn_id, char** data, size_t* len, char* peer) {
+    struct msg_queue* q = &g_requests;
+
+    pthread_mutex_lock(&q->lock);
+    while (!q->head)
+        pthread_cond_wait(&q->nonempty, &q->lock);
+    struct msg* m = q->head;
+    q->head = m->next;
+    if (!q->head)
+        q->tail = NULL;
+    pthread_mutex_unlock(&q->lock);
+
+    *conn_id = m->conn_id;
+    *data = (char*)m->data;
+    *len = m->len;
+    memcpy(peer, m->peer, sizeof(m->peer));
+    free(m);
+    return 0;
+}
+
+/* Called from Haskell with an already length-prefixed response; copies it. */
+int server_post_response(uint64_t conn_id, const char* data, size_t len) {
+    unsigned char* copy = malloc(len);
+    if (!copy)
+        return 1;
+    memcpy(copy, data, len);
+    if (msg_push(&g_responses, conn_id, NULL, copy, len) != 0) {
+        free(copy);
+        return 1;
+    }
+    if (g_wake_fds[1] >= 0) {
+        char c = 0;
+        ssize_t unused = write(g_wake_fds[1], &c, 1); /* a full pipe is already a wake-up */
+        (void)unused;
+    }
+    return 0;
+}
+
+/*
+ * Per-connection state machine. Every state maps to one non-blocking
+ * mbedtls call; WANT_READ/WANT_WRITE park the connection on epoll and the
+ * next readiness event resumes it where it left off, so handshakes and
+ * reads of different clients interleave freely.
+ */
+enum conn_state {
+    CONN_FREE,
+    CONN_HANDSHAKE,
+    CONN_READ_HEADER,
+    CONN_READ_BODY,
+    CONN_DISPATCHED, /* waiting for Haskell */
+    CONN_WRITE,
+};
+
+struct conn {
+    enum conn_state state;
+    uint32_t gen;
+    mbedtls_net_context fd;
+    mbedtls_ssl_context ssl;
+    char peer[INET6_ADDRSTRLEN]; /* numeric address, the flow the scheduler queues under */
+    time_t last_active;
+    unsigned char hdr[8];
+    unsigned char* buf; /* request body being read, or response being written */
+    size_t len;
+    size_t off;
+};
+
+static struct conn* g_conns;
+static int* g_free_slots;
+static size_t g_max_conns;
+static size_t g_active;
+static int g_epfd = -1;
+static int g_listen_paused;
+static time_t g_listen_retry; /* after an accept error: when to listen again */
+static mbedtls_net_context* g_listen;
+
+static uint64_t conn_id(struct conn* c) {
+    return ((uint64_t)c->gen << 32) | (uint64_t)(c - g_conns);
+}
+
+static void conn_watch(struct conn* c, uint32_t events) {
+    struct epoll_event ev = {.events = events, .data.u64 = conn_id(c)};
+    epoll_ctl(g_epfd, EPOLL_CTL_MOD, c->fd.fd, &ev);
+}
+
+static void listen_watch(int on) {
+    struct epoll_event ev = {.events = on ? EPOLLIN : 0, .data.u64 = LISTEN_TAG};
+    epoll_ctl(g_epfd, EPOLL_CTL_MOD, g_listen->fd, &ev);
+    g_listen_paused = !on;
+}
+
+static void conn_close(struct conn* c) {
+    epoll_ctl(g_epfd, EPOLL_CTL_DEL, c->fd.fd, NULL);
+    mbedtls_ssl_free(&c->ssl);
+    mbedtls_net_free(&c->fd);
+    free(c->buf);
+    c->buf = NULL;
+    c->state = CONN_FREE;
+    c->gen++;
+    g_free_slots[g_max_conns - g_active] = (int)(c - g_conns);
+    g_active--;
+
+    if (g_listen_paused)
+        listen_watch(1);
+}
+
+/* > 0: progress made, 0: parked (dispatched or closed), < 0: mbedtls code */
+static int conn_step(struct conn* c) {
+    int ret;
+
+    switch (c->state) {
+        case CONN_HANDSHAKE:
+            ret = mbedtls_ssl_handshake(&c->ssl);
+            if (ret != 0)
+                return ret;
+            c->state = CONN_READ_HEADER;
+            c->off = 0;
+            return 1;
+
+        case CONN_READ_HEADER:
+            ret = mbedtls_ssl_read(&c->ssl, c->hdr + c->off, sizeof(c->hdr) - c->off);
+            if (ret <= 0)
+                return ret == 0 ? MBEDTLS_ERR_SSL_CONN_EOF : ret;
+            c->off += ret;
+            if (c->off < sizeof(c->hdr))
+                return 1;
+
+            /* big-endian length, see byteStrLength on the Haskell side */
+            c->len = 0;
+            for (size_t i = 0; i < sizeof(c->hdr); i++)
+                c->len = (c->len << 8) | c->hdr[i];
+            if (c->len == 0 || c->len > MAX_REQUEST_SIZE)
+                return MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
+
+            c->buf = malloc(c->len);
+            if (!c->buf)
+                return MBEDTLS_ERR_SSL_ALLOC_FAILED;
+            c->off = 0;
+            c->state = CONN_READ_BODY;
+            return 1;
+
+        case CONN_READ_BODY:
+            ret = mbedtls_ssl_read(&c->ssl, c->buf + c->off, c->len - c->off);
+            if (ret <= 0)
+                return ret == 0 ? MBEDTLS_ERR_SSL_CONN_EOF : ret;
+            c->off += ret;
+            if (c->off < c->len)
+                return 1;
+
+            if (msg_push(&g_requests, conn_id(c), c->peer, c->buf, c->len) != 0)
+                return MBEDTLS_ERR_SSL_ALLOC_FAILED;
+            c->buf = NULL;
+            c->state = CONN_DISPATCHED;
+            conn_watch(c, 0); /* hang-ups are still reported */
+            return 0;
+
+        case CONN_WRITE:
+            ret = mbedtls_ssl_write(&c->ssl, c->buf + c->off, c->len - c->off);
+            if (ret <= 0)
+                return ret == 0 ? MBEDTLS_ERR_SSL_CONN_EOF : ret;
+            c->off += ret;
+            if (c->off < c->len)
+                return 1;
+
+            /* keep the connection for the next request; the client closes. It may have sent
+             * that request already, so read on rather than wait for EPOLLIN (see conn_drive). */
+            free(c->buf);
+            c->buf = NULL;
+            c->off = 0;
+            c->state = CONN_READ_HEADER;
+            return 1;
+
+        default:
+            return 0;
+    }
+}
+
+/* Advance one connection as far as it goes without blocking. */
+static void conn_drive(struct conn* c) {
+    int ret;
+
+    c->last_active = time(NULL);
+    for (;;) {
+        while ((ret = conn_step(c)) > 0)
+            ;
+        /* records mbedtls has already pulled off the socket never raise EPOLLIN again */
+        if (ret != MBEDTLS_ERR_SSL_WANT_READ || !mbedtls_ssl_check_pending(&c->ssl))
+            break;
+    }
+
+    if (ret == 0)
+        return;
+
+    if (ret == MBEDTLS_ERR_SSL_WANT_READ) {
+        conn_watch(c, EPOLLIN);
+        return;
+    }
+
+    if (ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+        conn_watch(c, EPOLLOUT);
+        return;
+    }
+
+    if (ret != MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY && ret != MBEDTLS_ERR_SSL_CONN_EOF &&
+            ret != MBEDTLS_ERR_NET_CONN_RESET)
+        mbedtls_printf("  ! connection %lu failed with -0x%x\n", (unsigned long)conn_id(c), -ret);
+    conn_close(c);
+}
+
+static void accept_connections(mbedtls_ssl_config* conf) {
+    int ret;
+
+    while (g_active < g_max_conns) {
+        mbedtls_net_context client_fd;
+        unsigned char ip[16];
+        size_t ip_len = 0;
+        mbedtls_net_init(&client_fd);
+
+        ret = mbedtls_net_accept(g_listen, &client_fd, ip, sizeof(ip), &ip_len);
+        if (ret == MBEDTLS_ERR_SSL_WANT_READ)
+            return;
+        if (ret != 0) {
+            /* EMFILE, ENOMEM, ...: the listen fd stays readable, so stop watching it for a
+             * while instead of spinning on it; a closing connection also resumes it */
+            mbedtls_printf("  ! mbedtls_net_accept returned %d\n", ret);
+            g_listen_retry = time(NULL) + ACCEPT_RETRY_SEC;
+            listen_watch(0);
+            return;
+        }
+
+        struct conn* c = &g_conns[g_free_slots[g_max_conns - g_active - 1]];
+        c->fd = client_fd;
+        if (!inet_ntop(ip_len == 4 ? AF_INET : AF_INET6, ip, c->peer, sizeof(c->peer)))
+            snprintf(c->peer, sizeof(c->peer), "unknown");
+        mbedtls_ssl_init(&c->ssl);
+
+        struct epoll_event ev = {.events = EPOLLIN, .data.u64 = conn_id(c)};
+        if (mbedtls_net_set_nonblock(&c->fd) != 0 || mbedtls_ssl_setup(&c->ssl, conf) != 0 ||
+                epoll_ctl(g_epfd, EPOLL_CTL_ADD, c->fd.fd, &ev) != 0) {
+            mbedtls_printf("  ! could not set up connection\n");
+            mbedtls_ssl_free(&c->ssl);
+            mbedtls_net_free(&c->fd);
+            continue;
+        }
+
+        mbedtls_ssl_set_bio(&c->ssl, &c->fd, mbedtls_net_send, mbedtls_net_recv, NULL);
+        c->state = CONN_HANDSHAKE;
+        c->buf = NULL;
+        c->off = 0;
+        g_active++;
+        conn_drive(c);
+    }
+
+    /* at the connection cap; leave further clients in the listen backlog */
+    listen_watch(0);
+}
+
+static void deliver_responses(void) {
+    char drain[64];
+    while (read(g_wake_fds[0], drain, sizeof(drain)) > 0)
+        ;
+
+    struct msg* m = msg_take_all(&g_responses);
+    while (m) {
+        struct msg* next = m->next;
+        uint64_t slot = m->conn_id & 0xffffffff;
+        struct conn* c = slot < g_max_conns ? &g_conns[slot] : NULL;
+
+        if (c && c->state == CONN_DISPATCHED && conn_id(c) == m->conn_id) {
+            c->buf = m->data;
+            c->len = m->len;
+            c->off = 0;
+            c->state = CONN_WRITE;
+            conn_drive(c);
+        } else {
+            free(m->data); /* the client went away meanwhile */
+        }
+        free(m);
+        m = next;
+    }
+}
+
+static void close_idle_connections(void) {
+    time_t now = time(NULL);
+
+    for (size_t i = 0; i < g_max_conns; i++) {
+        struct conn* c = &g_conns[i];
+        if (c->state != CONN_FREE && c->state != CONN_DISPATCHED &&
+                now - c->last_active > IDLE_TIMEOUT_SEC)
+            conn_close(c);
+    }
+}
+
+int startServer(int backlog, int max_conns) {
+    int ret;
     const char* pers = "ssl_server";
     void* ra_tls_attest_lib;
 
@@ -89,14 +456,12 @@ int startServer(int *flag, char *data) {
 
     mbedtls_entropy_context entropy;
     mbedtls_ctr_drbg_context ctr_drbg;
-    mbedtls_ssl_context ssl;
+    mbedtls_net_context listen_fd;
     mbedtls_ssl_config conf;
     mbedtls_x509_crt srvcert;
     mbedtls_pk_context pkey;
 
     mbedtls_net_init(&listen_fd);
-    mbedtls_net_init(&client_fd);
-    mbedtls_ssl_init(&ssl);
     mbedtls_ssl_config_init(&conf);
     mbedtls_x509_crt_init(&srvcert);
     mbedtls_pk_init(&pkey);
@@ -248,6 +613,13 @@ int startServer(int *flag, char *data) {
         goto exit;
     }
 
+    /* mbedtls_net_bind() listens with a fixed backlog of 10; widen it */
+    if (listen(listen_fd.fd, backlog) != 0 || mbedtls_net_set_nonblock(&listen_fd) != 0) {
+        ret = MBEDTLS_ERR_NET_LISTEN_FAILED;
+        mbedtls_printf(" failed\n  ! listen/set_nonblock failed\n\n");
+        goto exit;
+    }
+
     mbedtls_printf(" ok\n");
 
     // ABHI : Setup stuff
@@ -276,151 +648,81 @@ int startServer(int *flag, char *data) {
         goto exit;
     }
 
-    ret = mbedtls_ssl_setup(&ssl, &conf);
-    if (ret != 0) {
-        mbedtls_printf(" failed\n  ! mbedtls_ssl_setup returned %d\n\n", ret);
-        goto exit;
-    }
-
     mbedtls_printf(" ok\n");
 
-reset:
-#ifdef MBEDTLS_ERROR_C
-    if (ret != 0) {
-        char error_buf[100];
-        mbedtls_strerror(ret, error_buf, sizeof(error_buf));
-        mbedtls_printf("Last error was: %d - %s\n\n", ret, error_buf);
-    }
-#endif
-
-    mbedtls_net_free(&client_fd);
-
-    mbedtls_ssl_session_reset(&ssl);
+    // Event loop setup: connection table, wake-up pipe and epoll set
 
-    //ABHI : wait until a client connects
-
-    mbedtls_printf("  . Waiting for a remote connection ...");
+    mbedtls_printf("  . Setting up the event loop (%d connections)...", max_conns);
     fflush(stdout);
 
-    ret = mbedtls_net_accept(&listen_fd, &client_fd, NULL, 0, NULL);
-    if (ret != 0) {
-        mbedtls_printf(" failed\n  ! mbedtls_net_accept returned %d\n\n", ret);
+    g_max_conns  = max_conns > 0 ? (size_t)max_conns : 1;
+    g_active     = 0;
+    g_listen     = &listen_fd;
+    g_conns      = calloc(g_max_conns, sizeof(*g_conns));
+    g_free_slots = calloc(g_max_conns, sizeof(*g_free_slots));
+    if (!g_conns || !g_free_slots) {
+        ret = MBEDTLS_ERR_SSL_ALLOC_FAILED;
+        mbedtls_printf(" failed\n  ! out of memory\n\n");
         goto exit;
     }
+    for (size_t i = 0; i < g_max_conns; i++)
+        g_free_slots[i] = (int)(g_max_conns - 1 - i);
 
-    mbedtls_ssl_set_bio(&ssl, &client_fd, mbedtls_net_send, mbedtls_net_recv, NULL);
-
-    mbedtls_printf(" ok\n");
-
-    //ABHI: Handshake
-
-    mbedtls_printf("  . Performing the SSL/TLS handshake...");
-    fflush(stdout);
-
-    while ((ret = mbedtls_ssl_handshake(&ssl)) != 0) {
-        if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
-            mbedtls_printf(" failed\n  ! mbedtls_ssl_handshake returned %d\n\n", ret);
-            goto reset;
-        }
-    }
-
-    mbedtls_printf(" ok\n");
-
-    // ABHI: Read the HTTP Request
-
-    mbedtls_printf("  < Read from client:");
-    fflush(stdout);
-
-    do {
-        len = sizeof(buf) - 1;
-        memset(buf, 0, sizeof(buf));
-        ret = mbedtls_ssl_read(&ssl, buf, len);
-
-        if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE)
-            continue;
-
-        if (ret <= 0) {
-            switch (ret) {
-                case MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY:
-                    mbedtls_printf(" connection was closed gracefully\n");
-                    break;
-
-                case MBEDTLS_ERR_NET_CONN_RESET:
-                    mbedtls_printf(" connection was reset by peer\n");
-                    break;
-
-                default:
-                    mbedtls_printf(" mbedtls_ssl_read returned -0x%x\n", -ret);
-                    break;
-            }
-
-            break;
-        }
-
-        len = ret;
-        mbedtls_printf(" %lu bytes read\n\n%s", len, (char*)buf);
-
-        if (ret > 0)
-            break;
-    } while (1);
-
-
-    // ABHI: Data is received and is now in buf
-
-    memcpy(data, buf, len);// Copying the data so that Haskell can read it
-
-    *flag = 1;
-    // Haskell Thread operational now
-    unsigned int milliseconds = 200; // 200 milliseconds
-
-    while(*flag == 1){
-      usleep(milliseconds * 1000);
+    g_epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (g_epfd < 0 || pipe2(g_wake_fds, O_NONBLOCK | O_CLOEXEC) != 0) {
+        ret = MBEDTLS_ERR_NET_SOCKET_FAILED;
+        mbedtls_printf(" failed\n  ! epoll_create1/pipe2 failed: %s\n\n", strerror(errno));
+        goto exit;
     }
 
-
-    //Haskell has reset data
-    size_t size = 0;
-    for (int i = 0; i < sizeof(size_t); i++) {
-      size = (size << 8) | (uint8_t)data[i];
+    struct epoll_event ev = {.events = EPOLLIN, .data.u64 = LISTEN_TAG};
+    struct epoll_event wake_ev = {.events = EPOLLIN, .data.u64 = WAKE_TAG};
+    if (epoll_ctl(g_epfd, EPOLL_CTL_ADD, listen_fd.fd, &ev) != 0 ||
+            epoll_ctl(g_epfd, EPOLL_CTL_ADD, g_wake_fds[0], &wake_ev) != 0) {
+        ret = MBEDTLS_ERR_NET_SOCKET_FAILED;
+        mbedtls_printf(" failed\n  ! epoll_ctl failed: %s\n\n", strerror(errno));
+        goto exit;
     }
-    len = sizeof(size_t) + size;
-
-    memcpy(buf, data, len); // buf will be written back to client
+    g_listen_paused = 0;
 
+    mbedtls_printf(" ok\n");
 
-    mbedtls_printf("  > Write to client:");
-    fflush(stdout);
-
-    //len = sprintf((char*)buf, HTTP_RESPONSE, mbedtls_ssl_get_ciphersuite(&ssl)); //XXX: Abhi: writing the HTTP response here
-
-    while ((ret = mbedtls_ssl_write(&ssl, buf, len)) <= 0) {
-        if (ret == MBEDTLS_ERR_NET_CONN_RESET) {
-            mbedtls_printf(" failed\n  ! peer closed the connection\n\n");
-            goto reset;
-        }
+    //ABHI : serve forever
 
-        if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
-            mbedtls_printf(" failed\n  ! mbedtls_ssl_write returned %d\n\n", ret);
+    struct epoll_event events[EPOLL_BATCH];
+    for (;;) {
+        int n = epoll_wait(g_epfd, events, EPOLL_BATCH, 1000);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            ret = MBEDTLS_ERR_NET_POLL_FAILED;
+            mbedtls_printf("  ! epoll_wait failed: %s\n", strerror(errno));
             goto exit;
         }
-    }
-
-    len = ret;
-    mbedtls_printf(" %lu bytes written\n\n%s\n", len, (char*)buf);
 
-    mbedtls_printf("  . Closing the connection...");
-
-    while ((ret = mbedtls_ssl_close_notify(&ssl)) < 0) {
-        if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
-            mbedtls_printf(" failed\n  ! mbedtls_ssl_close_notify returned %d\n\n", ret);
-            goto reset;
+        for (int i = 0; i < n; i++) {
+            uint64_t tag = events[i].data.u64;
+            if (tag == LISTEN_TAG) {
+                accept_connections(&conf);
+            } else if (tag == WAKE_TAG) {
+                deliver_responses();
+            } else {
+                struct conn* c = &g_conns[tag & 0xffffffff];
+                if (c->state == CONN_FREE || conn_id(c) != tag)
+                    continue; /* closed earlier in this batch, maybe already reused */
+                if (c->state == CONN_DISPATCHED) {
+                    if (events[i].events & (EPOLLHUP | EPOLLERR))
+                        conn_close(c);
+                    continue;
+                }
+                conn_drive(c);
+            }
         }
-    }
-
-    mbedtls_printf(" ok\n");
 
-    ret = 0;
-    goto reset; // ABHI: recursion and loop the server
+        close_idle_connections();
+        if (g_listen_paused && g_active < g_max_conns && time(NULL) >= g_listen_retry)
+            listen_watch(1);
+    }
 
 exit:
 #ifdef MBEDTLS_ERROR_C
@@ -434,12 +736,28 @@ exit:
     if (ra_tls_attest_lib)
         dlclose(ra_tls_attest_lib);
 
-    mbedtls_net_free(&client_fd);
+    if (g_conns) {
+        for (size_t i = 0; i < g_max_conns; i++) {
+            if (g_conns[i].state != CONN_FREE) {
+                mbedtls_ssl_free(&g_conns[i].ssl);
+                mbedtls_net_free(&g_conns[i].fd);
+                free(g_conns[i].buf);
+            }
+        }
+    }
+    free(g_conns);
+    free(g_free_slots);
+    g_conns = NULL;
+    g_free_slots = NULL;
+
+    if (g_epfd >= 0)
+        close(g_epfd);
+    g_epfd = -1;
+
     mbedtls_net_free(&listen_fd);
 
     mbedtls_x509_crt_free(&srvcert);
     mbedtls_pk_free(&pkey);
-    mbedtls_ssl_free(&ssl);
     mbedtls_ssl_config_free(&conf);
     mbedtls_ctr_drbg_free(&ctr_drbg);
     mbedtls_entropy_free(&entropy);
@@ -0,0 +1,302 @@
+{-# LANGUAGE DataKinds #-}
+{-# LANGUAGE ScopedTypeVariables #-}
+
+module Main (main) where
+
+import Control.Concurrent
+import Control.Exception
+import Control.Monad (forM, forM_, replicateM, unless, when)
+import Data.Binary
+import Data.IORef
+import Data.List (sort)
+import Data.Maybe (isJust)
+import Data.Proxy (Proxy(..))
+import GHC.Clock (getMonotonicTimeNSec)
+import GHC.TypeLits (KnownSymbol)
+import System.Environment (getArgs)
+import System.Exit (exitFailure)
+import Text.Printf (printf)
+import Text.Read (readMaybe)
+
+import qualified Data.Map.Strict as M
+
+import App
+import Client
+import DCLabel
+import Seal (Sealed)
+
+{-@ Load generator for a running enclave
+
+    Replays the two workloads shipped with the repository against an
+    enclave started separately (`cabal run -f enclave` for app/Main.hs,
+    `cabal run EnclaveIFC-bench` for app/Benchmark.hs):
+
+      covid   app/Main.hs: org1/org2 ingest rows, org3 runs the query
+      ingest  app/Main.hs: ingest only
+      query   app/Main.hs: query only
+      pwd     app/Benchmark.hs: the password check
+
+    Transports: `tcp` (runApp, plain TCP) and `ra` (runAppRA, mbedtls
+    with the certificates in ssl/; no SGX needed).
+
+    closed  `--concurrency` workers each issue the next request as soon
+            as the previous one returned.
+    open    requests are scheduled at a fixed `--rate` per second and
+            handed to `--concurrency` workers. Latency is measured from
+            the *scheduled* start, so a stalled server is charged for
+            the requests it kept us from sending (no coordinated
+            omission).
+
+    Closed-loop numbers are corrected for coordinated omission the way
+    HdrHistogram does it: a sample of latency L > E also records
+    L - E, L - 2E, ... where E is the expected interval between
+    requests of one worker (`--expected-us`, default: raw median).
+
+    Example:
+      EnclaveIFC-loadgen --workload covid --transport ra \
+                         --mode open --rate 200 --concurrency 16 --duration 30
+
+@-}
+
+data Transport = TCP | RA deriving (Eq, Show)
+
+data Mode = Closed | Open deriving (Eq, Show)
+
+data Config = Config { cfgWorkload    :: String
+                     , cfgTransport   :: Transport
+                     , cfgMode        :: Mode
+                     , cfgConcurrency :: Int
+                     , cfgDuration    :: Double  -- ^ seconds
+                     , cfgRate        :: Double  -- ^ requests/second (open)
+                     , cfgExpected    :: Maybe Double -- ^ microsec (closed)
+                     , cfgQueryEvery  :: Int     -- ^ covid: 1 query per n ops
+                     }
+
+parseConfig :: [String] -> Either String Config
+parseConfig args = do
+  opts <- pairs args
+  let opt k d = M.findWithDefault d k opts
+  transport <- case opt "transport" "tcp" of
+                 "tcp" -> Right TCP
+                 "ra"  -> Right RA
+                 t     -> Left ("unknown transport " <> t)
+  mode <- case opt "mode" "closed" of
+            "closed" -> Right Closed
+            "open"   -> Right Open
+            m        -> Left ("unknown mode " <> m)
+  let num :: (Read n, Ord n, Num n) => String -> String -> Either String n
+      num k v = case readMaybe v of
+                  Just n | n > 0 -> Right n
+                  _              -> Left ("invalid --" <> k <> " " <> v)
+  concurrency <- num "concurrency" (opt "concurrency" "4")
+  duration    <- num "duration" (opt "duration" "10")
+  rate        <- num "rate" (opt "rate" "100")
+  expected    <- traverse (num "expected-us") (M.lookup "expected-us" opts)
+  queryEvery  <- num "query-every" (opt "query-every" "10")
+  return Config { cfgWorkload    = opt "workload" "covid"
+                , cfgTransport   = transport
+                , cfgMode        = mode
+                , cfgConcurrency = concurrency
+                , cfgDuration    = duration
+                , cfgRate        = rate
+                , cfgExpected    = expected
+                , cfgQueryEvery  = queryEvery
+                }
+  where
+    pairs (('-':'-':k):v:rest) = M.insert k v <$> pairs rest
+    pairs []                   = Right M.empty
+    pairs xs                   = Left ("cannot parse arguments " <> unwords xs)
+
+-- Wire-compatible copies of the app/Main.hs schema
+
+data CovidVariant = BA275 | XBB15 | DV71 | B1525 | P681 | B318
+  deriving (Show, Eq, Ord, Enum, Bounded)
+
+instance Binary CovidVariant where
+  put = putWord8 . fromIntegral . fromEnum
+  get = do
+    tag <- getWord8
+    if fromIntegral tag <= fromEnum (maxBound :: CovidVariant)
+    then return (toEnum $ fromIntegral tag)
+    else fail "Invalid tag for CovidVariant"
+
+data Row = Row CovidVariant Word8 deriving (Show, Eq)
+
+instance Binary Row where
+  put (Row var age) = put var >> put age
+  get = Row <$> get <*> get
+
+rowFor :: Int -> Row
+rowFor i = Row (toEnum (i `mod` 6)) (fromIntegral (20 + i `mod` 60))
+
+-- | Registered in the same order as the target app so the CallIDs line
+-- up; the method bodies only exist inside the enclave.
+data CovidAPI = CovidAPI { datasend :: Secure (DCLabeled Row -> EnclaveDC ())
+                         , runQ     :: Secure (EnclaveDC Sealed)
+                         }
+
+covidAPI :: App CovidAPI
+covidAPI = CovidAPI <$> inEnclave initState (\_ -> EnclaveDummy)
+                    <*> inEnclave initState EnclaveDummy
+  where
+    initState = dcDefaultState cTrue
+
+newtype PwdAPI = PwdAPI { checkpwd :: Secure (String -> EnclaveDC Bool) }
+
+pwdAPI :: App PwdAPI
+pwdAPI = PwdAPI <$> inEnclave (dcDefaultState cTrue) (\_ -> EnclaveDummy)
+
+call :: (Binary a, KnownSymbol loc)
+     => Transport -> Secure (EnclaveDC a) -> Client loc (Maybe a)
+call TCP = tryEnclave
+call RA  = raTryEnclave
+
+runCall :: Client loc a -> IO a
+runCall (Client _ io) = io
+
+ingest :: forall loc. KnownSymbol loc => Transport -> CovidAPI -> Int -> Client loc Bool
+ingest t api i = do
+  lrow <- clientLabel (loc %% loc) (rowFor i)
+  isJust <$> call t (datasend api <@> lrow)
+  where
+    loc = toLocTm (Proxy :: Proxy loc)
+
+query :: Transport -> CovidAPI -> Client "org3" Bool
+query t api = isJust <$> call t (runQ api)
+
+pwdCheck :: Transport -> PwdAPI -> Client "client" Bool
+pwdCheck t api = isJust <$> call t (checkpwd api <@> "password")
+
+-- | The i-th operation of a workload; True on success
+workload :: Config -> IO (Int -> IO Bool)
+workload cfg = case cfgWorkload cfg of
+  "covid"  -> do
+    api <- runApp "loadgen" covidAPI
+    return $ \i -> covid api i
+  "ingest" -> do
+    api <- runApp "loadgen" covidAPI
+    return $ \i -> runCall (ingest t api i :: Client "org1" Bool)
+  "query"  -> do
+    api <- runApp "loadgen" covidAPI
+    return $ \_ -> runCall (query t api)
+  "pwd"    -> do
+    api <- runApp "loadgen" pwdAPI
+    return $ \_ -> runCall (pwdCheck t api)
+  w -> ioError $ userError ("unknown workload " <> w)
+  where
+    t = cfgTransport cfg
+    covid api i
+      | i `mod` cfgQueryEvery cfg == 0 = runCall (query t api)
+      | even i    = runCall (ingest t api i :: Client "org1" Bool)
+      | otherwise = runCall (ingest t api i :: Client "org2" Bool)
+
+-- | One finished request, in nanoseconds
+data Sample = Sample { sampleLatency :: !Word64 -- ^ from the scheduled start
+                     , sampleService :: !Word64 -- ^ from the actual start
+                     , sampleOk      :: !Bool
+                     }
+
+timed :: (Int -> IO Bool) -> Int -> Word64 -> IO Sample
+timed op i scheduled = do
+  start <- getMonotonicTimeNSec
+  ok    <- op i `catch` \(e :: SomeException) -> do
+             putStrLn ("request failed: " <> show e)
+             return False
+  end   <- getMonotonicTimeNSec
+  return $ Sample (end - scheduled) (end - start) ok
+
+closedLoop :: Config -> (Int -> IO Bool) -> IO [Sample]
+closedLoop cfg op = do
+  t0      <- getMonotonicTimeNSec
+  counter <- newIORef 0
+  let stop = t0 + seconds (cfgDuration cfg)
+      go acc = do
+        now <- getMonotonicTimeNSec
+        if now >= stop
+        then return acc
+        else do
+          i <- atomicModifyIORef' counter (\n -> (n + 1, n))
+          s <- timed op i now
+          go (s : acc)
+  concat <$> concurrently (cfgConcurrency cfg) (go [])
+
+openLoop :: Config -> (Int -> IO Bool) -> IO [Sample]
+openLoop cfg op = do
+  t0      <- getMonotonicTimeNSec
+  counter <- newIORef 0
+  let interval = 1e9 / cfgRate cfg
+      total    = floor (cfgDuration cfg * cfgRate cfg) :: Int
+      go acc = do
+        i <- atomicModifyIORef' counter (\n -> (n + 1, n))
+        if i >= total
+        then return acc
+        else do
+          let scheduled = t0 + round (fromIntegral i * interval)
+          now <- getMonotonicTimeNSec
+          when (scheduled > now) $
+            threadDelay (fromIntegral ((scheduled - now) `div` 1000))
+          s <- timed op i scheduled
+          go (s : acc)
+  concat <$> concurrently (cfgConcurrency cfg) (go [])
+
+concurrently :: Int -> IO a -> IO [a]
+concurrently n io = do
+  vars <- replicateM (max 1 n) newEmptyMVar
+  forM_ vars $ \v -> forkIO (try io >>= putMVar v)
+  forM vars $ \v -> takeMVar v >>= either (\(e :: SomeException) -> throwIO e) return
+
+seconds :: Double -> Word64
+seconds s = round (s * 1e9)
+
+-- | HdrHistogram's recordValueWithExpectedInterval
+correctOmission :: Word64 -> [Word64] -> [Word64]
+correctOmission expected = concatMap backfill
+  where
+    backfill l
+      | expected == 0 || l <= expected = [l]
+      | otherwise = l : takeWhile (> 0) [l - k * expected | k <- [1 .. l `div` expected]]
+
+percentile :: Double -> [Word64] -> Word64
+percentile _ [] = 0
+percentile p sorted = sorted !! idx
+  where
+    n   = length sorted
+    idx = min (n - 1) (max 0 (ceiling (p * fromIntegral n) - 1))
+
+report :: String -> [Word64] -> IO ()
+report name ls = do
+  let sorted = sort ls
+      ms v   = fromIntegral v / 1e6 :: Double
+  printf "%-26s p50 %9.3f ms   p99 %9.3f ms   p999 %9.3f ms   max %9.3f ms\n"
+         name (ms $ percentile 0.5 sorted) (ms $ percentile 0.99 sorted)
+         (ms $ percentile 0.999 sorted) (ms $ if null sorted then 0 else last sorted)
+
+main :: IO ()
+main = do
+  args <- getArgs
+  cfg  <- either (\err -> putStrLn err >> exitFailure) return (parseConfig args)
+  op   <- workload cfg
+  printf "%s workload over %s, %s loop, concurrency %d, %.1f s\n"
+         (cfgWorkload cfg) (show $ cfgTransport cfg) (show $ cfgMode cfg)
+         (cfgConcurrency cfg) (cfgDuration cfg)
+  t0      <- getMonotonicTimeNSec
+  samples <- case cfgMode cfg of
+               Closed -> closedLoop cfg op
+               Open   -> openLoop cfg op
+  t1      <- getMonotonicTimeNSec
+  let total   = length samples
+      errors  = length (filter (not . sampleOk) samples)
+      elapsed = fromIntegral (t1 - t0) / 1e9 :: Double
+  unless (total == 0) $ do
+    printf "requests %d   errors %d (%.2f%%)   throughput %.1f req/s\n"
+           total errors (100 * fromIntegral errors / fromIntegral total :: Double)
+           (fromIntegral (total - errors) / elapsed)
+    let service = map sampleService samples
+    report "service time" service
+    case cfgMode cfg of
+      Open   -> report "latency (from schedule)" (map sampleLatency samples)
+      Closed -> do
+        let expected = maybe (percentile 0.5 (sort service)) (round . (* 1000))
+                             (cfgExpected cfg)
+        report ("latency (CO-corrected, E=" <> show (expected `div` 1000) <> "us)")
+               (correctOmission expected service)
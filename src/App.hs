@@ -11,9 +11,19 @@ import Data.Binary(Binary, encode, decode)
 import Data.Maybe(fromMaybe)
 import Network.Simple.TCP
 
+import Control.Exception (Exception)
+import Data.Array (Array, array, bounds, (!))
+import Data.Bits (xor)
 import Data.Dynamic
+import Data.Int (Int64)
+import Data.Ix (inRange)
+import Data.List (foldl')
+import Data.Typeable (Proxy(..), TypeRep, typeRep)
+import Data.Word (Word64)
 import DCLabel
 import qualified Data.Binary as B
+import qualified Data.ByteString as BS
+import qualified Data.ByteString.Lazy as BL
 
 {-@ The EnclaveIFC API for programmers
 
@@ -24,6 +34,7 @@ liftNewRef :: a -> App (Enclave (Ref a))
 newRef :: a -> Enclave (Ref a)
 readRef    :: Ref a -> Enclave a
 writeRef   :: Ref a -> a -> Enclave ()
+modifyRef  :: Ref a -> (a -> a) -> Enclave () -- atomic, for shared refs
 -- immutable value
 inEnclaveConstant :: a -> App (Enclave a)
 -- closures
@@ -47,8 +58,16 @@ tryEnclave :: Secure (Enclave a) -> Client (Maybe a)
 gateway :: Secure (Enclave a) -> Client a
 (<@>) :: Binary a => Secure (a -> b) -> a -> Secure b
 
+-- streaming variants, one connection per stream
+inEnclaveSink   :: (Labeled l a -> Enclave ()) -> App (SecureSink (Labeled l a))
+inEnclaveSource :: ((b -> Enclave ()) -> Enclave ()) -> App (SecureSource b)
+streamTo   :: SecureSink (Labeled l a) -> [Labeled l a] -> Client (Maybe Int) -- accepted
+streamFrom :: SecureSource b -> Client [b]             -- consumed lazily
+
 -- call this from `main` to run the App monad
 runApp :: App a -> IO a
+-- same as above, with explicit admission control and scheduling limits
+runAppWith :: SchedConfig -> App a -> IO a
 
 
 @-}
@@ -57,7 +76,7 @@ runApp :: App a -> IO a
 type Identifier = String
 type CallID = Int
 type Method = [ByteString] -> IO (Maybe ByteString)
-type AppState = (CallID, [(CallID, Method)], Identifier)
+type AppState = (CallID, [(CallID, MethodEntry)], Identifier)
 newtype App a = App (StateT AppState IO a)
   deriving (Functor, Applicative, Monad, MonadIO)
 
@@ -66,6 +85,61 @@ data Done = Done
 initAppState :: Identifier -> AppState
 initAppState str = (0,[], str)
 
+{-@ Method signatures
+
+    Every method is registered with its arity and a fingerprint of its
+    argument and result types, and every request carries the signature
+    the client was compiled against. The enclave compares the two before
+    it decodes a single argument, so a call to an unknown method, with
+    the wrong number of arguments or built against other types is
+    rejected from the request header alone.
+
+    Client and enclave are separate programs, and a client may declare
+    its own copies of the enclave's types (see `loadgen`), so the
+    fingerprint hashes the shown types (FNV-1a) rather than the
+    `Typeable` fingerprints, which also cover the defining module.
+@-}
+data MethodSig = MethodSig { sigArity       :: !Int
+                           , sigFingerprint :: !Word64
+                           } deriving (Eq, Show)
+
+instance Binary MethodSig where
+  put (MethodSig arity fp) = B.put arity >> B.put fp
+  get = MethodSig <$> B.get <*> B.get
+
+-- | Signature of a method taking arguments of the given types, result last.
+methodSig :: [TypeRep] -> MethodSig
+methodSig reps = MethodSig (Prelude.length reps - 1) (fnv1a (show reps))
+  where
+    fnv1a = foldl' (\h c -> (h `xor` fromIntegral (fromEnum c)) * 1099511628211)
+                   14695981039346656037
+
+-- | Stream calls take one `StreamMsg`; the stream's handle type, say
+-- `SecureSink (Labeled DCLabel Row)`, stands in for the result.
+streamSig :: Typeable h => Proxy h -> MethodSig
+streamSig handle = methodSig [typeRep (Proxy :: Proxy StreamMsg), typeRep handle]
+
+data MethodEntry = MethodEntry { entrySig    :: !MethodSig
+                               , entryMethod :: Method
+                               }
+
+-- | The methods of an `App`, indexed by CallID once it has run.
+type MethodTable = Array CallID MethodEntry
+
+-- | CallIDs are handed out densely from 0, so the table has no holes.
+freezeMethods :: [(CallID, MethodEntry)] -> MethodTable
+freezeMethods remotes = array (0, Prelude.length remotes - 1) remotes
+
+-- | The method a request may run, judged from its header alone.
+resolveMethod :: MethodTable -> Request -> Maybe Method
+resolveMethod table (Request _ identifier sig args)
+  | not (inRange (bounds table) identifier) = Nothing
+  | entrySig entry /= sig                   = Nothing
+  | Prelude.length args /= sigArity sig     = Nothing
+  | otherwise                               = Just (entryMethod entry)
+  where
+    entry = table ! identifier
+
 -- Client-enclave communication utils follow
 
 localhost :: String
@@ -82,12 +156,104 @@ connectPort = "8000"
 
 @-}
 createPayload :: Binary a => a -> ByteString
-createPayload msg = append bytstr msgBody
+createPayload msg = createFrame (encode msg)
+
+-- | The same framing for a message body that is already serialised.
+createFrame :: ByteString -> ByteString
+createFrame msgBody = append bytstr msgBody
   where
-    msgBody = encode msg
     msgSize = Data.ByteString.Lazy.length msgBody
     bytstr  = encode msgSize
 
+{-@ Every call travels as a `Request`: the location of the caller, the
+    id of the method inside the enclave, the signature the caller
+    expects it to have and its serialised arguments. The enclave keys
+    admission control and fair queuing on the caller.
+@-}
+data Request = Request { reqCaller :: Identifier
+                       , reqCallID :: CallID
+                       , reqSig    :: MethodSig
+                       , reqArgs   :: [ByteString]
+                       }
+
+instance Binary Request where
+  put (Request caller identifier sig args) =
+    B.put caller >> B.put identifier >> B.put sig >> B.put args
+  get = Request <$> B.get <*> B.get <*> B.get <*> B.get
+
+-- | Outcome of a call as reported by the enclave.
+data Status = Served    -- ^ The method ran; the payload holds its result
+            | Busy      -- ^ Shed by admission control, try again later
+            | Expired   -- ^ Missed its queueing deadline or timed out
+            | Rejected  -- ^ Failed verification or unknown method
+            | Exhausted -- ^ Enclave over its memory budget, try again later
+            deriving (Eq, Show, Enum, Bounded)
+
+instance Binary Status where
+  put st = B.putWord8 (fromIntegral $ fromEnum st)
+  get = do
+    tag <- B.getWord8
+    if fromIntegral tag <= fromEnum (maxBound :: Status)
+    then return (toEnum $ fromIntegral tag)
+    else fail "Invalid tag for Status"
+
+type Response = (Status, Maybe ByteString)
+
+{-@ Streams are driven by ordinary calls to the CallID of a sink or
+    source, each carrying one `StreamMsg` as its only argument and
+    answered with a `StreamReply` as its result.
+
+    sink:    Open -> Ack sid credit, Push sid records -> Ack sid credit,
+             ..., End sid -> Ack sid 0 while the sink drains (send End
+             again later), End sid -> Closed
+    source:  Open -> Ack sid 0, Pull sid n -> Chunks chunks done, ...
+             (no chunks while the source is busy; pull again later)
+             End sid cancels
+
+    No message waits for the enclave side, so a stream never holds a
+    scheduler worker; the client backs off between polls.
+@-}
+type StreamID = Word64
+
+data StreamMsg = StreamOpen
+               | StreamPush StreamID ByteString   -- ^ Records back to back (`LabelCodec`),
+                                                  --   at most the granted credit
+               | StreamPull StreamID Int          -- ^ Up to n chunks
+               | StreamEnd  StreamID              -- ^ Sink: input done; source: cancel
+
+data StreamReply = StreamAck StreamID Int         -- ^ Credit left for pushes
+                 | StreamChunks [ByteString] Bool -- ^ True once the source is done
+                 | StreamClosed                   -- ^ Passed the final label check
+                 | StreamFailed String
+
+instance Binary StreamMsg where
+  put StreamOpen             = B.putWord8 0
+  put (StreamPush sid recs)  = B.putWord8 1 >> B.put sid >> B.put recs
+  put (StreamPull sid n)     = B.putWord8 2 >> B.put sid >> B.put n
+  put (StreamEnd sid)        = B.putWord8 3 >> B.put sid
+  get = do
+    tag <- B.getWord8
+    case tag of
+      0 -> return StreamOpen
+      1 -> StreamPush <$> B.get <*> B.get
+      2 -> StreamPull <$> B.get <*> B.get
+      3 -> StreamEnd  <$> B.get
+      _ -> fail "Invalid tag for StreamMsg"
+
+instance Binary StreamReply where
+  put (StreamAck sid credit)   = B.putWord8 0 >> B.put sid >> B.put credit
+  put (StreamChunks cs done)   = B.putWord8 1 >> B.put cs >> B.put done
+  put StreamClosed             = B.putWord8 2
+  put (StreamFailed err)       = B.putWord8 3 >> B.put err
+  get = do
+    tag <- B.getWord8
+    case tag of
+      0 -> StreamAck <$> B.get <*> B.get
+      1 -> StreamChunks <$> B.get <*> B.get
+      2 -> return StreamClosed
+      3 -> StreamFailed <$> B.get
+      _ -> fail "Invalid tag for StreamReply"
+
 readTCPSocket :: (MonadIO m) => Socket -> m ByteString
 readTCPSocket socket = do
   -- first 8 bytes (Int64) encodes the msg size
@@ -99,6 +265,35 @@ readTCPSocket socket = do
   where
     err = error "Error parsing request"
 
+-- | Matches MAX_REQUEST_SIZE and MAX_RESPONSE_SIZE of the C front ends.
+maxMessageSize :: Int
+maxMessageSize = 64 * 1024 * 1024
+
+-- | Reads one length-prefixed message, looping over short reads.
+-- Nothing once the peer has closed the connection, so a connection can
+-- carry any number of messages. A length outside 0..`maxMessageSize` is
+-- treated like a closed connection rather than allocated for.
+recvFrame :: Socket -> IO (Maybe ByteString)
+recvFrame socket = do
+  hdr <- recvExactly socket 8
+  case hdr of
+    Nothing -> return Nothing
+    Just h
+      | size < 0 || size > fromIntegral maxMessageSize -> return Nothing
+      | otherwise -> fmap fromStrict <$> recvExactly socket (fromIntegral size)
+      where
+        size = decode (fromStrict h) :: Int64
+
+recvExactly :: Socket -> Int -> IO (Maybe BS.ByteString)
+recvExactly socket = go []
+  where
+    go acc 0 = return $ Just (BS.concat (reverse acc))
+    go acc n = do
+      chunk <- recv socket n
+      case chunk of
+        Nothing -> return Nothing
+        Just c  -> go (c : acc) (n - BS.length c)
+
 
 -- | Internal state of an 'LIO' computation.
 data LIOState l p = LIOState { lioLabel     :: !l -- ^ Current label.
@@ -120,12 +315,44 @@ dcDefaultState p = LIOState { lioLabel     = dcPublic
 
 -- data Labeled l t = LabeledTCB !l t deriving Typeable
 
+{-@ A labeled value travels as its label followed by the length-prefixed
+    encoding of the value. Decoding one yields `LabeledRawTCB`: the label
+    is decoded, the value stays as a slice of the received bytes next to
+    a lazy `decodeOrFail` of them, forced by the first `unlabel`. A record
+    that is only stored and passed on is never decoded, and encoding it
+    again reuses the bytes it arrived as. Bytes that turn out not to
+    decode make that `unlabel` throw `LabeledDecodeError`; forcing the
+    stored record itself never throws.
+@-}
 data Labeled l t where
-  LabeledTCB :: (Binary l, Binary t) => l -> t -> Labeled l t
+  LabeledTCB    :: (Binary l, Binary t) => l -> t -> Labeled l t
+  LabeledRawTCB :: (Binary l, Binary t) => l -> ByteString -> Either String t -> Labeled l t
+
+-- | A raw value whose bytes are not a complete encoding of its type.
+newtype LabeledDecodeError = LabeledDecodeError String deriving (Eq, Show)
+
+instance Exception LabeledDecodeError
+
+-- | The value must be decoded from exactly these bytes.
+labeledRawTCB :: (Binary l, Binary t) => l -> ByteString -> Labeled l t
+labeledRawTCB l bytes = LabeledRawTCB l bytes $ case B.decodeOrFail bytes of
+  Right (rest, _, t) | BL.null rest -> Right t
+                     | otherwise    -> Left "Trailing bytes after labeled value"
+  Left (_, _, err)                  -> Left err
+
+labelTCB :: Labeled l t -> l
+labelTCB (LabeledTCB l _)      = l
+labelTCB (LabeledRawTCB l _ _) = l
+
+-- | Decodes a raw value on first use.
+valueTCB :: Labeled l t -> Either LabeledDecodeError t
+valueTCB (LabeledTCB _ t)      = Right t
+valueTCB (LabeledRawTCB _ _ t) = either (Left . LabeledDecodeError) Right t
+
+payloadTCB :: Labeled l t -> ByteString
+payloadTCB (LabeledTCB _ t)          = encode t
+payloadTCB (LabeledRawTCB _ bytes _) = bytes
 
 instance (Binary l, Binary t) => Binary (Labeled l t) where
-  put (LabeledTCB l t) = B.put l >> B.put t
-  get = do
-    l <- B.get
-    t <- B.get
-    return (LabeledTCB l t)
+  put lv = B.put (labelTCB lv) >> B.put (payloadTCB lv)
+  get = labeledRawTCB <$> B.get <*> B.get
@@ -0,0 +1,97 @@
+module Capture (module Capture) where
+
+import Control.Concurrent.MVar
+import Data.Binary (Binary, decodeOrFail, encode, get, put)
+import Data.Int (Int64)
+import Data.Word (Word64)
+import System.IO
+
+import Crypto.PubKey.RSA.Types (PublicKey)
+
+import App
+import Seal
+import Stats (bumpStat)
+
+import qualified Data.ByteString.Lazy as BL
+
+{-@ Request capture for offline replay
+
+    With `schedCapture` set, the scheduler appends every request it
+    admits, as the worker picks it up, to a trace file together with its
+    arrival time. Requests that are shed, expire in the queue or fail
+    signature verification or method lookup never ran, so they are not
+    recorded and a replay does not run them. A trace holds the raw
+    inputs of every principal, so each record is sealed (see `Seal`) for
+    `captureKey`: the key of whoever operates the replays, whose private
+    half no client holds. Do not reuse a key that results are sealed
+    for. The key is part of the configuration, so it is measured with
+    the enclave when it is built in; a key read from the host's disk at
+    startup could be swapped by the host. Records are
+    framed like a request on the wire:
+
+      8 bytes length, Sealed (TraceRecord time request)
+
+    `replayApp` in `Enclave` reads a trace back with the operator's
+    private key and runs it against the methods of the same `App`.
+    Streams are captured like any other call but do not replay: their
+    ids are drawn at random when they are opened.
+
+@-}
+
+data CaptureConfig = CaptureConfig { captureTrace :: FilePath -- ^ Appended to
+                                   , captureKey   :: PublicKey -- ^ Operator's, seals the records
+                                   }
+
+data TraceRecord = TraceRecord { trTime    :: !Word64 -- ^ monotonic nanoseconds
+                               , trRequest :: Request
+                               }
+
+instance Binary TraceRecord where
+  put (TraceRecord t req) = put t >> put req
+  get = TraceRecord <$> get <*> get
+
+data Capture = Capture { capSealer :: Sealer
+                       , capHandle :: MVar Handle -- ^ one writer at a time
+                       }
+
+openCapture :: CaptureConfig -> IO Capture
+openCapture (CaptureConfig path pubK) = do
+  h <- openBinaryFile path AppendMode
+  Capture <$> newSealer pubK <*> newMVar h
+
+-- | Flushed per record, so a crashed enclave leaves a usable trace.
+captureRequest :: Capture -> Word64 -> Request -> IO ()
+captureRequest (Capture sealer lock) arrival req = do
+  sealed <- seal sealer (BL.toStrict $ encode (TraceRecord arrival req))
+  withMVar lock $ \h -> BL.hPut h (createPayload sealed) >> hFlush h
+  bumpStat "capture.records" 1
+
+-- | All records up to the first one that is truncated or fails to
+-- open, which is reported.
+readTrace :: Opener -> FilePath -> IO [TraceRecord]
+readTrace opener path = BL.readFile path >>= go (0 :: Int)
+  where
+    go n bytes
+      | BL.null bytes = return []
+      | otherwise = do
+          r <- next bytes
+          case r of
+            Right (record, rest) -> (record :) <$> go (n + 1) rest
+            Left err -> do
+              putStrLn $ "Trace: " <> err <> " after " <> show n <> " records"
+              return []
+    next bytes = do
+      let (hdr, rest) = BL.splitAt 8 bytes
+          size        = either (const (-1)) (\(_, _, s) -> s) (decodeOrFail hdr) :: Int64
+          (body, rest') = BL.splitAt size rest
+      if BL.length hdr < 8 || size < 0 || BL.length body < size
+      then return (Left "truncated record")
+      else case decodeOrFail body of
+        Left (_, _, err)     -> return (Left err)
+        Right (_, _, sealed) -> do
+          opened <- unseal opener sealed
+          return $ do
+            plain <- opened
+            case decodeOrFail (BL.fromStrict plain) of
+              Left (_, _, err)     -> Left err
+              Right (_, _, record) -> Right (record, rest')
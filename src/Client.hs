@@ -9,16 +9,25 @@
 
 module Client(module Client) where
 
-import Data.Bits (shift, (.|.))
 import Data.Maybe
+import Data.Word (Word64)
 import Control.Monad.IO.Class
 import Control.Monad.Trans.State.Strict
 import Data.ByteString.Lazy(ByteString)
 import Data.Binary(Binary, encode, decode)
 import Network.Simple.TCP
 import App
+import Compress (clientCompression, openEnvelope, sealEnvelope)
 import DCLabel
 import Label -- holds the Label typeclass
+import LabelCodec
+import Memory (Footprint)
+import Scheduler (SchedConfig)
+
+import Control.Concurrent (threadDelay)
+import Control.Exception (bracket, throwIO)
+import Data.IORef
+import System.IO.Unsafe (unsafeInterleaveIO)
 
 
 import Foreign.C
@@ -30,6 +39,9 @@ import qualified Data.ByteString.Lazy as BL
 
 import GHC.TypeLits
 import Data.Proxy
+import Data.Typeable (TypeRep, Typeable, typeRep)
+
+import Crypto.PubKey.RSA.Types (PublicKey)
 
 #ifdef INTEGRITY
 import Crypto.Hash.Algorithms (SHA512)
@@ -38,19 +50,21 @@ import Crypto.PubKey.RSA.PKCS15
 
 data Ref l a = RefDummy
 data Enclave l p a = EnclaveDummy deriving (Functor, Applicative, Monad, MonadIO)
-data Secure a = Secure CallID [ByteString]
+-- | The signature is that of the whole method, however many arguments
+-- have been applied.
+data Secure a = Secure CallID MethodSig [ByteString]
 
 
 (<@>) :: Binary a => Secure (a -> b) -> a -> Secure b
-(Secure identifier args) <@> arg =
-  Secure identifier (encode arg : args)
+(Secure identifier sig args) <@> arg =
+  Secure identifier sig (encode arg : args)
 
 {- The Securable a constraint is necessary for the Enclave type -}
 inEnclave :: (Securable a, Label l) => LIOState l p -> a -> App (Secure a)
-inEnclave _ _ = App $ do
+inEnclave _ f = App $ do
   (next_id, remotes, ident) <- get
   put (next_id + 1, remotes, ident)
-  return $ Secure next_id []
+  return $ Secure next_id (securableSig f) []
 
 
 getPrivilege :: Enclave l p (Priv p)
@@ -60,15 +74,22 @@ getPrivilege = EnclaveDummy
 class Securable a where
   mkSecure :: (Label l)
            => LIOState l p -> a -> ([ByteString] -> Enclave l p (Maybe ByteString))
+  -- | Argument types, then the result type, as in the enclave
+  securableTypes :: Proxy a -> [TypeRep]
+
+securableSig :: forall a. Securable a => a -> MethodSig
+securableSig _ = methodSig (securableTypes (Proxy :: Proxy a))
 
 -- instance (Binary a) => Securable (Enclave a) where
 --   mkSecure m = \_ -> fmap (Just . encode) m
 
-instance (Binary a, Label l) => Securable (Enclave l p a) where
+instance (Binary a, Typeable a, Label l) => Securable (Enclave l p a) where
   mkSecure _ _ = \_ -> EnclaveDummy
+  securableTypes _ = [typeRep (Proxy :: Proxy a)]
 
-instance (Binary a, Securable b) => Securable (a -> b) where
+instance (Binary a, Typeable a, Securable b) => Securable (a -> b) where
   mkSecure _ _  = \_ -> EnclaveDummy
+  securableTypes _ = typeRep (Proxy :: Proxy a) : securableTypes (Proxy :: Proxy b)
 
 inEnclaveConstant :: (Label l) => l -> a -> App (Enclave l p (Labeled l a))
 inEnclaveConstant _ _ = return EnclaveDummy
@@ -78,6 +99,10 @@ liftNewRef :: Label l
            => l -> a -> App (Enclave l p (Ref l a))
 liftNewRef _ _ = return EnclaveDummy
 
+liftNewRefSized :: (Label l, Footprint a)
+                => String -> l -> a -> App (Enclave l p (Ref l a))
+liftNewRefSized _ _ _ = return EnclaveDummy
+
 liftNewRefP :: p -> l -> a -> App (Enclave l p (Ref l a))
 liftNewRefP _ _ _ = return EnclaveDummy
 
@@ -108,6 +133,43 @@ writeRef _ _ = EnclaveDummy
 writeRefP :: Priv p -> Ref l a -> a -> Enclave l p ()
 writeRefP _ _ _ = EnclaveDummy
 
+readRefVersion :: Label l => Ref l a -> Enclave l p (Word64, a)
+readRefVersion _ = EnclaveDummy
+
+modifyRef :: Label l => Ref l a -> (a -> a) -> Enclave l p ()
+modifyRef _ _ = EnclaveDummy
+
+modifyRefP :: Priv p -> Ref l a -> (a -> a) -> Enclave l p ()
+modifyRefP _ _ _ = EnclaveDummy
+
+data LabeledMap l k v = LabeledMapDummy
+
+newLabeledMap :: Label l => l -> Enclave l p (LabeledMap l k v)
+newLabeledMap _ = EnclaveDummy
+
+liftNewLabeledMap :: Label l => l -> App (Enclave l p (LabeledMap l k v))
+liftNewLabeledMap _ = return EnclaveDummy
+
+lookupLabeledMap :: (Label l, Ord k) => LabeledMap l k v -> k -> Enclave l p (Maybe v)
+lookupLabeledMap _ _ = EnclaveDummy
+
+lookupLabeledMapLabeled :: (Label l, Ord k)
+                        => LabeledMap l k v -> k -> Enclave l p (Maybe (Labeled l v))
+lookupLabeledMapLabeled _ _ = EnclaveDummy
+
+insertLabeledMap :: (Label l, Binary l, Binary v, Ord k)
+                 => LabeledMap l k v -> k -> l -> v -> Enclave l p ()
+insertLabeledMap _ _ _ _ = EnclaveDummy
+
+adjustLabeledMap :: (Label l, Ord k) => LabeledMap l k v -> k -> (v -> v) -> Enclave l p ()
+adjustLabeledMap _ _ _ = EnclaveDummy
+
+deleteLabeledMap :: (Label l, Ord k) => LabeledMap l k v -> k -> Enclave l p ()
+deleteLabeledMap _ _ = EnclaveDummy
+
+labeledMapKeys :: Label l => LabeledMap l k v -> Enclave l p [k]
+labeledMapKeys _ = EnclaveDummy
+
 
 -- data Labeled l t = LabeledDummy
 
@@ -150,11 +212,32 @@ toLabeledP _ _ _ = EnclaveDummy
 
 
 labelOf :: Label l => Labeled l a -> l
-labelOf (LabeledTCB l _) = l
+labelOf = labelTCB
 
 inEnclaveLabeledConstant :: Label l => l -> a -> App (Enclave l p (Labeled l a))
 inEnclaveLabeledConstant _ _ = return $ EnclaveDummy
 
+data MappedConstant l a = MappedConstantDummy
+
+inEnclaveMappedConstant :: (Label l, Binary a)
+                        => PublicKey -> FilePath -> l -> FilePath
+                        -> App (Enclave l p (MappedConstant l a))
+inEnclaveMappedConstant _ _ _ _ = return EnclaveDummy
+
+mappedSize :: MappedConstant l a -> Enclave l p Int
+mappedSize _ = EnclaveDummy
+
+lookupMapped :: (Label l, Binary a) => MappedConstant l a -> Int -> Enclave l p (Maybe a)
+lookupMapped _ _ = EnclaveDummy
+
+lookupMappedLabeled :: (Label l, Binary l, Binary a)
+                    => MappedConstant l a -> Int -> Enclave l p (Maybe (Labeled l a))
+lookupMappedLabeled _ _ = EnclaveDummy
+
+searchMapped :: (Label l, Binary a, Ord k)
+             => (a -> k) -> k -> MappedConstant l a -> Enclave l p (Maybe a)
+searchMapped _ _ _ = EnclaveDummy
+
 
 
 clientLabel :: (Label l, KnownSymbol loc, Binary l, Binary a)
@@ -163,7 +246,7 @@ clientLabel l a = return (LabeledTCB l a)
 
 clientUnLabel :: (Label l, KnownSymbol loc, Binary l, Binary a)
               => Labeled l a -> Client loc a
-clientUnLabel (LabeledTCB _ a) = return a
+clientUnLabel lv = either (liftIO . throwIO) return (valueTCB lv)
 
 
 -- | Generalising monads with locations
@@ -214,17 +297,28 @@ runClient (Client loc cl) = App $ do
 
 
 
-tryEnclave :: (Binary a, KnownSymbol loc)
+tryEnclave :: forall loc l p a. (Binary a, KnownSymbol loc)
            => Secure (Enclave l p a) -> Client loc (Maybe a)
-tryEnclave (Secure identifier args) = Client Proxy $ do
+tryEnclave (Secure identifier sig args) = Client Proxy $ do
   {- SENDING REQUEST HERE -}
   connect localhost connectPort $ \(connectionSocket, remoteAddr) -> do
     -- debug logs
     putStrLn $ "Connection established to " ++ show remoteAddr
-    sendLazy connectionSocket $ createPayload (identifier, reverse args)
-    resp <- readTCPSocket connectionSocket
-    return $ fmap decode (decode resp :: Maybe ByteString)
+    sendLazy connectionSocket $ createPayload (Request caller identifier sig (reverse args))
+    resp <- recvFrame connectionSocket
+    maybe (return Nothing) fromResponse resp
   {- SENDING ENDS -}
+  where
+    caller = toLocTm (Proxy :: Proxy loc)
+
+-- | Anything but `Served` is reported and turned into `Nothing`.
+fromResponse :: Binary a => ByteString -> IO (Maybe a)
+fromResponse resp =
+  case decode resp :: Response of
+    (Served, result) -> return (fmap decode result)
+    (status, _)      -> do
+      putStrLn $ "Enclave answered " ++ show status
+      return Nothing
 
 gateway :: (Binary a, KnownSymbol loc) => Secure (Enclave l p a) -> Client loc a
 gateway closure = fromJust <$> tryEnclave closure
@@ -232,53 +326,87 @@ gateway closure = fromJust <$> tryEnclave closure
 runApp :: Identifier -> App a -> IO a
 runApp ident (App s) = evalStateT s (initAppState ident)
 
-foreign import ccall "setup_ra_tls_send" setup_ra_tls_send
-    :: Ptr CChar -> CSize -> Ptr CChar -> Ptr CChar -> IO CInt
-
--- XXX: not portable;
--- 8 bytes for this machine
--- big-endian order used for the data packets
-byteStrLength :: Ptr CChar -> IO Int
-byteStrLength cptr = go 0 []
+-- | Scheduling only happens inside the enclave
+runAppWith :: SchedConfig -> Identifier -> App a -> IO a
+runAppWith _ = runApp
+
+{-@ A `Session` is one connection to the enclave that carries any
+    number of calls; the enclave keeps it open until we close it.
+    `raTryEnclave` opens one per call, streams one per stream.
+@-}
+data Session = Session { sessionCall  :: Request -> IO (Maybe ByteString)
+                       , sessionClose :: IO ()
+                       }
+
+tcpSession :: IO (Maybe Session)
+tcpSession = do
+  (socket, _) <- connectSock localhost connectPort
+  return $ Just $
+    Session (\req -> sendLazy socket (createPayload req) >> recvFrame socket)
+            (closeSock socket)
+
+foreign import ccall "ra_tls_session_open" ra_tls_session_open
+    :: Ptr CChar -> IO (Ptr ())
+
+foreign import ccall "ra_tls_session_call" ra_tls_session_call
+    :: Ptr () -> Ptr CChar -> CSize -> Ptr (Ptr CChar) -> Ptr CSize -> IO CInt
+
+foreign import ccall "ra_tls_session_close" ra_tls_session_close
+    :: Ptr () -> IO ()
+
+-- | Handshake and attestation happen here, once per session. Messages
+-- travel in envelopes; requests are compressed once a reply has shown
+-- that the enclave accepts it (see `Compress`).
+raSession :: IO (Maybe Session)
+raSession = do
+  conn <- withCString "native" ra_tls_session_open
+  if conn == nullPtr
+  then return Nothing
+  else do
+    peerAccepts <- newIORef False
+    return $ Just $ Session (raCall conn peerAccepts) (ra_tls_session_close conn)
   where
-    go 8 xs = do
-      let (i0:i1:i2:i3:i4:i5:i6:i7:_) = reverse xs
-      let y = (shift i0 56) .|. (shift i1 48) .|. (shift i2 40) .|.
-              (shift i3 32) .|. (shift i4 24) .|. (shift i5 16) .|.
-              (shift i6  8) .|. i7
-      return y
-    go i xs = do
-      cchar <- peekElemOff cptr i
-      go (i + 1) ((fromEnum cchar):xs)
-
-dataPacketSize :: Int
-dataPacketSize = 1024
-
-raTryEnclave :: (Label l, Binary a, KnownSymbol loc)
-             => Secure (Enclave l p a) -> Client loc (Maybe a)
-raTryEnclave (Secure identifier args) = Client Proxy $ do
+    raCall conn peerAccepts req = do
 #ifdef INTEGRITY
-  let inputBytes' = BL.toStrict $ encode $ (identifier, reverse args)
-  inputBytes <- createSigMsg inputBytes'
+      inputBytes <- createSigMsg (BL.toStrict $ encode req)
 #else
-  let inputBytes = BL.toStrict $ encode $ (identifier, reverse args)
+      let inputBytes = BL.toStrict $ encode req
 #endif
-  withCString "native" $ \cstring -> do
-    B.useAsCStringLen inputBytes $ \(ptr, len) -> do
-      respptr  <- mallocBytes dataPacketSize :: IO (Ptr CChar)
-      cByteStr <- setup_ra_tls_send ptr (fromIntegral len) cstring respptr
-      let errorcode = fromEnum cByteStr :: Int
-      -- putStrLn $ "Hs to C and back " <> (show errorcode)
-      if (errorcode == 1)
-      then do
-        free respptr
-        return Nothing
-      else do
-        l <- byteStrLength respptr
-        -- XXX: not portable 8 bytes for this machine
-        byteString <- B.packCStringLen (respptr `plusPtr` 8, l)
-        free respptr
-        return $ fmap decode (decode $ BL.fromStrict byteString :: Maybe ByteString)
+      accepts <- readIORef peerAccepts
+      env     <- sealEnvelope clientCompression accepts (BL.fromStrict inputBytes)
+      B.useAsCStringLen (BL.toStrict env) $ \(ptr, len) ->
+        alloca $ \respptr -> alloca $ \lenptr -> do
+          errorcode <- ra_tls_session_call conn ptr (fromIntegral len) respptr lenptr
+          if errorcode /= 0
+          then return Nothing
+          else do
+            resp  <- peek respptr
+            n     <- peek lenptr
+            -- the C side malloc'ed the response and handed it over to us
+            bytes <- B.packCStringLen (resp, fromIntegral n)
+            free resp
+            opened <- openEnvelope (BL.fromStrict bytes)
+            case opened of
+              Left err -> do
+                putStrLn $ "Malformed response: " ++ err
+                return Nothing
+              Right (enclaveAccepts, msg) -> do
+                writeIORef peerAccepts enclaveAccepts
+                return (Just msg)
+
+withSession :: IO (Maybe Session) -> (Session -> IO (Maybe a)) -> IO (Maybe a)
+withSession open k = bracket open (mapM_ sessionClose) (maybe (return Nothing) k)
+
+callSession :: Binary a => Session -> Request -> IO (Maybe a)
+callSession sess req = sessionCall sess req >>= maybe (return Nothing) fromResponse
+
+raTryEnclave :: forall loc l p a. (Label l, Binary a, KnownSymbol loc)
+             => Secure (Enclave l p a) -> Client loc (Maybe a)
+raTryEnclave (Secure identifier sig args) = Client Proxy $
+  withSession raSession $ \sess ->
+    callSession sess (Request caller identifier sig (reverse args))
+  where
+    caller = toLocTm (Proxy :: Proxy loc)
 
 --return $ fmap decode $ Just $ encode errorcode
 gatewayRA :: (Binary a, Label l, KnownSymbol loc)
@@ -291,6 +419,135 @@ gatewayRA closure = (fromMaybe raerr) <$> (raTryEnclave closure)
 runAppRA :: Identifier -> App a -> IO a
 runAppRA ident (App s) = evalStateT s (initAppState ident)
 
+runAppRAWith :: SchedConfig -> Identifier -> App a -> IO a
+runAppRAWith _ = runAppRA
+
+
+data SecureSink a = SecureSink CallID MethodSig
+
+data SecureSource b = SecureSource CallID MethodSig
+
+nextCallID :: App CallID
+nextCallID = App $ do
+  (next_id, remotes, ident) <- get
+  put (next_id + 1, remotes, ident)
+  return next_id
+
+inEnclaveSink :: forall l p a. (Label l, LabelCodec l, Binary a, Typeable l, Typeable a)
+              => LIOState l p -> (Labeled l a -> Enclave l p ())
+              -> App (SecureSink (Labeled l a))
+inEnclaveSink _ _ =
+  SecureSink <$> nextCallID <*> pure (streamSig (Proxy :: Proxy (SecureSink (Labeled l a))))
+
+inEnclaveSource :: forall l p b. (Label l, Binary b, Typeable b)
+                => LIOState l p -> ((b -> Enclave l p ()) -> Enclave l p ())
+                -> App (SecureSource b)
+inEnclaveSource _ _ =
+  SecureSource <$> nextCallID <*> pure (streamSig (Proxy :: Proxy (SecureSource b)))
+
+streamPullBatch :: Int
+streamPullBatch = 64
+
+minBackoff, maxBackoff :: Int
+minBackoff = 1000  -- microsec
+maxBackoff = 50000
+
+streamCall :: Session -> Identifier -> CallID -> MethodSig -> StreamMsg
+           -> IO (Maybe StreamReply)
+streamCall sess caller identifier sig msg =
+  callSession sess (Request caller identifier sig [encode msg])
+
+streamFailed :: Maybe StreamReply -> IO ()
+streamFailed reply = putStrLn $ "Stream failed: " ++ reason
+  where
+    reason = case reply of
+      Just (StreamFailed err) -> err
+      Just _                  -> "unexpected reply"
+      Nothing                 -> "no reply"
+
+-- | Push records into a sink over one connection, never sending more
+-- than the enclave's credit. The number of records accepted, or
+-- Nothing if the stream failed. Labels are sent once per stream.
+streamTo :: forall loc l a. (LabelCodec l, Binary a, KnownSymbol loc)
+         => SecureSink (Labeled l a) -> [Labeled l a] -> Client loc (Maybe Int)
+streamTo sink xs = Client Proxy $
+  withSession tcpSession (pushStream (toLocTm (Proxy :: Proxy loc)) sink xs)
+
+raStreamTo :: forall loc l a. (LabelCodec l, Binary a, KnownSymbol loc)
+           => SecureSink (Labeled l a) -> [Labeled l a] -> Client loc (Maybe Int)
+raStreamTo sink xs = Client Proxy $
+  withSession raSession (pushStream (toLocTm (Proxy :: Proxy loc)) sink xs)
+
+pushStream :: (LabelCodec l, Binary a)
+           => Identifier -> SecureSink (Labeled l a) -> [Labeled l a] -> Session
+           -> IO (Maybe Int)
+pushStream caller (SecureSink identifier sig) records sess = do
+  opened <- call StreamOpen
+  case opened of
+    Just (StreamAck sid credit) -> go emptyLabelEncoder sid credit 0 records minBackoff
+    other                       -> streamFailed other >> return Nothing
+  where
+    call = streamCall sess caller identifier sig
+    go enc sid _ sent [] backoff = do
+      r <- call (StreamEnd sid)
+      case r of
+        Just StreamClosed    -> return (Just sent)
+        Just (StreamAck _ _) -> do
+          -- the sink is still draining; ask again later
+          threadDelay backoff
+          go enc sid 0 sent [] (min maxBackoff (2 * backoff))
+        other                -> streamFailed other >> return Nothing
+    go enc sid 0 sent rest backoff = do
+      -- the enclave's buffer is full; ask for credit again later
+      threadDelay backoff
+      r <- call (StreamPush sid BL.empty)
+      case r of
+        Just (StreamAck _ credit) -> go enc sid credit sent rest (min maxBackoff (2 * backoff))
+        other                     -> streamFailed other >> return Nothing
+    go enc sid credit sent rest _ = do
+      let (batch, later) = splitAt credit rest
+          (enc', recs)   = encodeLabeledBatch enc batch
+      r <- call (StreamPush sid recs)
+      case r of
+        Just (StreamAck _ credit') -> go enc' sid credit' (sent + length batch) later minBackoff
+        other                      -> streamFailed other >> return Nothing
+
+-- | The chunks a source yields, fetched lazily as the list is consumed.
+-- The connection is closed when the source is done, so consume the
+-- whole list. A failure ends the list early and is reported.
+streamFrom :: forall loc b. (Binary b, KnownSymbol loc)
+           => SecureSource b -> Client loc [b]
+streamFrom src = Client Proxy $
+  tcpSession >>= maybe (return []) (pullStream (toLocTm (Proxy :: Proxy loc)) src)
+
+raStreamFrom :: forall loc b. (Binary b, KnownSymbol loc)
+             => SecureSource b -> Client loc [b]
+raStreamFrom src = Client Proxy $
+  raSession >>= maybe (return []) (pullStream (toLocTm (Proxy :: Proxy loc)) src)
+
+pullStream :: Binary b => Identifier -> SecureSource b -> Session -> IO [b]
+pullStream caller (SecureSource identifier sig) sess = do
+  opened <- call StreamOpen
+  case opened of
+    Just (StreamAck sid _) -> pull sid minBackoff
+    other                  -> finish other
+  where
+    call = streamCall sess caller identifier sig
+    pull sid backoff = unsafeInterleaveIO $ do
+      r <- call (StreamPull sid streamPullBatch)
+      case r of
+        Just (StreamChunks [] False)     -> do
+          -- nothing buffered yet; poll again later
+          threadDelay backoff
+          pull sid (min maxBackoff (2 * backoff))
+        Just (StreamChunks chunks False) -> (map decode chunks ++) <$> pull sid minBackoff
+        Just (StreamChunks chunks True)  -> sessionClose sess >> return (map decode chunks)
+        other                            -> finish other
+    finish r = do
+      sessionClose sess
+      streamFailed r
+      return []
+
 
 #ifdef INTEGRITY
 -- Integrity Checking with Digital Signatures
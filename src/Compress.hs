@@ -0,0 +1,136 @@
+module Compress (module Compress) where
+
+import Data.Bits ((.&.), (.|.))
+import Data.Word (Word8, Word64)
+import Foreign.C
+import Foreign.Marshal.Alloc (alloca)
+import Foreign.Ptr
+import Foreign.Storable (peek)
+
+import Data.Binary.Get (getWord64be, runGetOrFail)
+import Data.Binary.Put (putWord64be, runPut)
+
+import App (maxMessageSize)
+import Stats (bumpStat)
+
+import qualified Data.ByteString as B
+import qualified Data.ByteString.Internal as BI
+import qualified Data.ByteString.Lazy as BL
+import qualified Data.ByteString.Unsafe as BU
+
+{-@ Message envelopes and compression
+
+    Over RA-TLS every request and response travels in an envelope, so
+    a message can be LZ4-compressed before TLS encrypts it:
+
+      envelope := flags (1 byte), body
+      flags    := bit 0: body is compressed
+                  bit 1: the sender accepts compressed messages
+      compressed body := original length (8 bytes, big-endian), LZ4 block
+
+    Compression is negotiated per connection. A client sends its first
+    request plain and marks it as accepting; the enclave compresses a
+    reply only for a client that accepts, and a client compresses
+    requests only once a reply has said the enclave accepts. Messages
+    under `compMinSize` and messages that do not shrink are sent plain.
+
+    The compressed length of a message depends on its contents, so the
+    enclave compresses only when `schedCompress` is turned on. Otherwise
+    it neither compresses nor advertises it, and clients send plain
+    requests too.
+
+    Counters: "compress.bytes_in"/"compress.bytes_out" (with the derived
+    "compress.ratio_pct"), "compress.cpu_ns", "compress.skipped" for
+    messages that did not shrink, and "decompress.bytes"/"decompress.cpu_ns".
+@-}
+
+data Compression = Compression { compEnabled :: !Bool
+                               , compMinSize :: !Int -- ^ Bytes; smaller messages go plain
+                               }
+
+-- | Clients always accept compression; whether it is used is up to the
+-- enclave (`schedCompress`).
+clientCompression :: Compression
+clientCompression = Compression True 4096
+
+flagCompressed, flagAccepts :: Word8
+flagCompressed = 1
+flagAccepts    = 2
+
+foreign import ccall unsafe "lz4_compress_bound" c_compress_bound
+    :: CSize -> CSize
+
+-- | The last argument receives the CPU time of the call, measured in C
+-- so that both readings come from the same OS thread.
+foreign import ccall unsafe "lz4_compress" c_compress
+    :: Ptr Word8 -> CSize -> Ptr Word8 -> CSize -> Ptr Word64 -> IO CSize
+
+foreign import ccall unsafe "lz4_decompress" c_decompress
+    :: Ptr Word8 -> CSize -> Ptr Word8 -> CSize -> Ptr Word64 -> IO CLong
+
+-- | Wraps a message, compressing it if `peerAccepts` and it is worth it.
+sealEnvelope :: Compression -> Bool -> BL.ByteString -> IO BL.ByteString
+sealEnvelope (Compression enabled minSize) peerAccepts msg
+  | enabled && peerAccepts && BL.length msg >= fromIntegral minSize = do
+      packed <- compressMessage (BL.toStrict msg)
+      return $ case packed of
+        Just body -> BL.cons (flagCompressed .|. advertise) (BL.fromStrict body)
+        Nothing   -> plain
+  | otherwise = return plain
+  where
+    advertise = if enabled then flagAccepts else 0
+    plain     = BL.cons advertise msg
+
+-- | The message, and whether its sender accepts compressed replies.
+openEnvelope :: BL.ByteString -> IO (Either String (Bool, BL.ByteString))
+openEnvelope env = case BL.uncons env of
+  Nothing -> return (Left "Empty envelope")
+  Just (flags, body)
+    | flags .&. flagCompressed == 0 -> return (Right (accepts, body))
+    | otherwise -> fmap (\msg -> (accepts, BL.fromStrict msg))
+                     <$> decompressMessage (BL.toStrict body)
+    where
+      accepts = flags .&. flagAccepts /= 0
+
+-- | Length header and LZ4 block; Nothing if that is no smaller.
+compressMessage :: B.ByteString -> IO (Maybe B.ByteString)
+compressMessage src = do
+  (block, cpu) <- alloca $ \cpuptr -> do
+    block <- BU.unsafeUseAsCStringLen src $ \(sptr, n) -> do
+      let bound = fromIntegral $ c_compress_bound (fromIntegral n)
+      BI.createAndTrim bound $ \dptr ->
+        fromIntegral <$> c_compress (castPtr sptr) (fromIntegral n) dptr (fromIntegral bound) cpuptr
+    (,) block <$> peek cpuptr
+  bumpStat "compress.cpu_ns" (fromIntegral cpu)
+  let packed = BL.toStrict (runPut (putWord64be (fromIntegral (B.length src)))) <> block
+  if B.null block || B.length packed >= B.length src
+  then bumpStat "compress.skipped" 1 >> return Nothing
+  else do
+    bumpStat "compress.bytes_in" (B.length src)
+    bumpStat "compress.bytes_out" (B.length packed)
+    return (Just packed)
+
+decompressMessage :: B.ByteString -> IO (Either String B.ByteString)
+decompressMessage packed =
+  case runGetOrFail getWord64be (BL.fromStrict packed) of
+    Left _ -> return (Left "Truncated compressed message")
+    Right (_, used, size64)
+      | size64 > fromIntegral maxMessageSize -> return (Left "Compressed message too large")
+      -- an LZ4 block expands at most 255-fold, so a length it cannot
+      -- reach is refused before the buffer for it is allocated
+      | size64 > 255 * fromIntegral (B.length block) + 16 ->
+          return (Left "Compressed message longer than its block allows")
+      | otherwise -> do
+          let size = fromIntegral size64
+          (msg, (r, cpu)) <- alloca $ \cpuptr ->
+            BU.unsafeUseAsCStringLen block $ \(sptr, n) ->
+              BI.createAndTrim' size $ \dptr -> do
+                got <- c_decompress (castPtr sptr) (fromIntegral n) dptr (fromIntegral size) cpuptr
+                cpu <- peek cpuptr
+                return (0, if got < 0 then 0 else size, (got, cpu))
+          bumpStat "decompress.cpu_ns" (fromIntegral cpu)
+          if r < 0
+          then return (Left "Malformed compressed message")
+          else bumpStat "decompress.bytes" size >> return (Right msg)
+      where
+        block = B.drop (fromIntegral used) packed
@@ -18,29 +18,47 @@ import Data.Binary(Binary, encode, decode)
 import Data.ByteString.Lazy(ByteString)
 import Data.IORef
 import Network.Simple.TCP
+import qualified Network.Socket as NS
 import System.IO(hFlush, stdout)
 import App
+import Capture
+import Compress (Compression(..), openEnvelope, sealEnvelope)
 import DCLabel
 import Label -- holds the Label typeclass
+import LabelCodec
+import Mapped (MappedFile, mappedRecord, mfCount, openMapped)
+import Memory
+import Scheduler
+import Seal (loadOpener)
+import Stats (LabelOp(..), bumpStat, countLabelOp, printStats)
 
 import qualified Data.ByteString.Char8 as BC
 import qualified Data.ByteString.Lazy as BL
 import qualified Data.ByteString as B
+import qualified Data.Map.Strict as M
+import qualified Data.Sequence as Seq
 
 import Control.Concurrent
 import Control.Exception
-import Data.Bits (shift, (.|.))
 import Data.Char (ord)
 import Foreign.C
 import Foreign.Marshal.Alloc
 import Foreign.Ptr
 import Foreign.Storable
 import GHC.Generics
-import GHC.IO.Handle.Text
 
-import Control.Monad (ap, unless)
+import Control.Monad (ap, forM_, forever, unless, void, when)
+import Crypto.PubKey.RSA.Types (PublicKey)
+import Crypto.Random (getRandomBytes)
+import Data.Binary (decodeOrFail)
 import Data.Dynamic
+import Data.Typeable (Proxy(..), TypeRep, typeRep)
+import Data.Foldable (toList)
 import Data.Maybe (fromMaybe)
+import Data.Sequence (Seq, ViewL(..), (|>))
+import Data.Word (Word64)
+import GHC.Clock (getMonotonicTimeNSec)
+import GHC.Conc (getAllocationCounter)
 
 import GHC.TypeLits
 
@@ -106,6 +124,9 @@ modifyLIOStateTCB f = do
   putLIOStateTCB (f s)
 
 
+countOp :: LabelOp -> Enclave l p ()
+countOp op = Enclave $ \_ -> countLabelOp op
+
 getPrivilege :: Enclave l p (Priv p)
 getPrivilege = do
   LIOState { lioPrivilege = lioPriv } <- getLIOStateTCB
@@ -140,6 +161,7 @@ evalLIO lio s_dyn = do
 
 guardAlloc :: Label l => l -> Enclave l p ()
 guardAlloc newl = do
+  countOp OpGuard
   LIOState { lioLabel = l_cur, lioClearance = c_cur } <- getLIOStateTCB
   unless (l_cur `canFlowTo` newl) $ error ("Can't flow to " <> (show newl))
   unless (newl `canFlowTo` c_cur) $ error ("Below clearance level " <>
@@ -147,6 +169,7 @@ guardAlloc newl = do
 
 guardAllocP :: PrivDesc l p => Priv p -> l -> Enclave l p ()
 guardAllocP p newl = do
+  countOp OpGuard
   LIOState { lioLabel = l_cur, lioClearance = c_cur } <- getLIOStateTCB
   unless (canFlowToP p l_cur newl) $ error ("Can't flow to " <> (show newl))
   unless (canFlowTo newl c_cur) $ error ("Below clearance level " <>
@@ -159,6 +182,7 @@ provided (L_cur ⊔ l) ⊑ C_cur
 -}
 taint :: Label l => l -> Enclave l p ()
 taint newl = do
+  countOp OpTaint
   LIOState { lioLabel = l_cur, lioClearance = c_cur } <- getLIOStateTCB
   let l' = l_cur `lub` newl
   unless (l' `canFlowTo` c_cur) $
@@ -167,6 +191,7 @@ taint newl = do
 
 taintP :: PrivDesc l p => Priv p -> l -> Enclave l p ()
 taintP p newl = do
+  countOp OpTaint
   LIOState { lioLabel = l_cur, lioClearance = c_cur } <- getLIOStateTCB
   let l' = l_cur `lub` downgradeP p newl
   unless (l' `canFlowTo` c_cur) $
@@ -179,12 +204,14 @@ action label l v returns a labeled value that protects v with l
 -}
 label :: (Label l, Binary l, Binary a) => l -> a -> Enclave l p (Labeled l a)
 label l a = do
+  countOp OpLabel
   guardAlloc l
   return $ LabeledTCB l a
 
 labelP :: (PrivDesc l p, Binary l, Binary a)
        => Priv p -> l -> a -> Enclave l p (Labeled l a)
 labelP p l a = do
+  countOp OpLabel
   guardAllocP p l
   return $ LabeledTCB l a
 
@@ -193,20 +220,27 @@ raises the current label, clearance permitting (see `taint`) to the join of
 of lv’s label and the current label, returning the value with the label removed.
 -}
 unlabel :: Label l => Labeled l a -> Enclave l p a
-unlabel (LabeledTCB l v) = do
-  taint l
-  return v
+unlabel lv = do
+  countOp OpUnlabel
+  taint (labelTCB lv)
+  unlabeledValue lv
 
 unlabelP :: PrivDesc l p => Priv p -> Labeled l a -> Enclave l p a
-unlabelP p (LabeledTCB l v) = do
-  taintP p l
-  return v
+unlabelP p lv = do
+  countOp OpUnlabel
+  taintP p (labelTCB lv)
+  unlabeledValue lv
+
+-- | Fails with `LabeledDecodeError` if a raw value does not decode, so
+-- that only the computation reading it is aborted.
+unlabeledValue :: Labeled l a -> Enclave l p a
+unlabeledValue lv = Enclave $ \_ -> either throwIO return (valueTCB lv)
 
 {-|
 If lv is a labeled value with label l and value v, labelOf lv returns l
 -}
 labelOf :: Label l => Labeled l a -> l
-labelOf (LabeledTCB l _) = l
+labelOf = labelTCB
 
 {-|
 Given a label l such that L_cur ⊑ l ⊑ C_cur and an LIO action m,
@@ -215,6 +249,7 @@ toLabeled l m executes m without raising L_cur.
 toLabeled :: (Label l, Binary l, Binary a)
           => l -> Enclave l p a -> Enclave l p (Labeled l a)
 toLabeled l m = do
+  countOp OpToLabeled
   -- | get the label and clearance before running the computation
   LIOState { lioLabel = l_cur
            , lioClearance = c_cur
@@ -242,6 +277,7 @@ toLabeled l m = do
 toLabeledP :: (PrivDesc l p, Binary l, Binary a) =>
               Priv p -> l -> Enclave l p a -> Enclave l p (Labeled l a)
 toLabeledP p l m = do
+  countOp OpToLabeled
   -- | get the label and clearance before running the computation
   LIOState { lioLabel = l_cur
            , lioClearance = c_cur
@@ -273,9 +309,90 @@ toLabeledP p l m = do
 
 inEnclaveLabeledConstant :: (Label l, Binary l, Binary a)
                          => l -> a -> App (Enclave l p (Labeled l a))
-inEnclaveLabeledConstant l a = return $ return $ LabeledTCB l a
-
-data Ref l a = LIORef !l (IORef a)
+inEnclaveLabeledConstant l a = App $ do
+  liftIO $ bumpStat "mem.constants" (binaryFootprint a)
+  return $ return $ LabeledTCB l a
+
+{-@ A labeled constant too large to build in the heap, backed by a
+    dataset written with `writeMapped` (see `Mapped`). Registering it maps
+    the file; each lookup decrypts and decodes one record and taints
+    with the constant's label, so records are paid for only when used.
+    `writer` is the public key the dataset's header must be signed with;
+    it is part of the program, so the host cannot substitute its own.
+    `keyFile` holds the private key matching the public key the data key
+    is wrapped for.
+@-}
+data MappedConstant l a = MappedConstant !l MappedFile
+
+inEnclaveMappedConstant :: (Label l, Binary a)
+                        => PublicKey -> FilePath -> l -> FilePath
+                        -> App (Enclave l p (MappedConstant l a))
+inEnclaveMappedConstant writer keyFile l path = App $ do
+  mf <- liftIO $ loadOpener keyFile >>= \opener -> openMapped writer opener path
+  return $ return (MappedConstant l mf)
+
+-- | The number of records is not protected by the label.
+mappedSize :: MappedConstant l a -> Enclave l p Int
+mappedSize (MappedConstant _ mf) = return (mfCount mf)
+
+-- | Record i, Nothing if out of range.
+lookupMapped :: (Label l, Binary a) => MappedConstant l a -> Int -> Enclave l p (Maybe a)
+lookupMapped (MappedConstant l mf) i = do
+  taint l
+  Enclave $ \_ -> decodeMapped mf i
+
+-- | Record i under the constant's label, without tainting.
+lookupMappedLabeled :: (Label l, Binary l, Binary a)
+                    => MappedConstant l a -> Int -> Enclave l p (Maybe (Labeled l a))
+lookupMappedLabeled (MappedConstant l mf) i =
+  Enclave $ \_ -> fmap (LabeledTCB l) <$> decodeMapped mf i
+
+-- | Binary search over a dataset written in ascending order of `key`.
+searchMapped :: (Label l, Binary a, Ord k)
+             => (a -> k) -> k -> MappedConstant l a -> Enclave l p (Maybe a)
+searchMapped key k (MappedConstant l mf) = do
+  taint l
+  Enclave $ \_ -> go 0 (mfCount mf - 1)
+  where
+    go lo hi
+      | lo > hi   = return Nothing
+      | otherwise = do
+          let mid = (lo + hi) `div` 2
+          r <- decodeMapped mf mid
+          case r of
+            Just a | key a < k -> go (mid + 1) hi
+                   | key a > k -> go lo (mid - 1)
+            _                  -> return r
+
+-- | A record that fails authentication or decoding is an error, not a miss.
+decodeMapped :: Binary a => MappedFile -> Int -> IO (Maybe a)
+decodeMapped mf i
+  | i < 0 || i >= mfCount mf = return Nothing
+  | otherwise = case mappedRecord mf i of
+      Left err    -> throwIO (userError err)
+      Right bytes -> case decodeOrFail (BL.fromStrict bytes) of
+        Left (_, _, err) -> throwIO (userError ("Mapped: " <> err))
+        Right (_, _, a)  -> return (Just a)
+
+{-@ References are versioned. A write publishes a new immutable version
+    with a single atomic swap, so `readRef` takes a consistent snapshot
+    in O(1) (tainting as before) and a long reader keeps its snapshot
+    while writers move on; a version is garbage once no reader holds it.
+    `modifyRef` is the atomic read-modify-write: unlike `readRef`
+    followed by `writeRef`, concurrent writers cannot lose an update.
+@-}
+data Version a = Version { verNumber :: !Word64
+                         , verValue  :: !a
+                         }
+
+data Ref l a = LIORef !l (IORef (Version a))
+
+newVersioned :: a -> IO (IORef (Version a))
+newVersioned a = newIORef (Version 0 a)
+
+publish :: IORef (Version a) -> (a -> a) -> IO ()
+publish ref f =
+  atomicModifyIORef' ref $ \(Version n a) -> (Version (n + 1) (f a), ())
 
 newRef :: Label l
        => l                   -- ^ Label of reference
@@ -283,7 +400,7 @@ newRef :: Label l
        -> Enclave l p (Ref l a) -- ^ Mutable reference
 newRef l a = do
   guardAlloc l
-  Enclave $ \_ -> (LIORef l `fmap` newIORef a)
+  Enclave $ \_ -> (LIORef l `fmap` newVersioned a)
 
 newRefP :: PrivDesc l p
         => Priv p              -- ^ Privilege
@@ -292,13 +409,36 @@ newRefP :: PrivDesc l p
         -> Enclave l p (Ref l a) -- ^ Mutable reference
 newRefP p l a = do
   guardAllocP p l
-  Enclave $ \_ -> (LIORef l `fmap` newIORef a)
+  Enclave $ \_ -> (LIORef l `fmap` newVersioned a)
 
 
 liftNewRef :: Label l
            => l -> a -> App (Enclave l p (Ref l a))
 liftNewRef l a = App $ do
-  r <- liftIO $ newIORef a
+  r <- liftIO $ newVersioned a
+  return $ do
+    guardAlloc l
+    return (LIORef l r)
+
+
+-- | `liftNewRef` that also reports the approximate size of the ref's
+-- contents as the "mem.ref.<name>" gauge.
+liftNewRefSized :: (Label l, Footprint a)
+                => String -> l -> a -> App (Enclave l p (Ref l a))
+liftNewRefSized name l a = App $ do
+  r     <- liftIO $ newVersioned a
+  sized <- liftIO $ newIORef Nothing
+  -- the current version only; older ones still held by readers are
+  -- missed. Walked again only after a write.
+  liftIO $ registerCensus ("ref." <> name) $ do
+    Version n v <- readIORef r
+    known <- readIORef sized
+    case known of
+      Just (m, bytes) | m == n -> return bytes
+      _                        -> do
+        bytes <- evaluate (footprint v)
+        writeIORef sized (Just (n, bytes))
+        return bytes
   return $ do
     guardAlloc l
     return (LIORef l r)
@@ -307,7 +447,7 @@ liftNewRef l a = App $ do
 liftNewRefP :: PrivDesc l p
             => Priv p -> l -> a -> App (Enclave l p (Ref l a))
 liftNewRefP p l a = App $ do
-  r <- liftIO $ newIORef a
+  r <- liftIO $ newVersioned a
   return $ do
     guardAllocP p l
     return (LIORef l r)
@@ -316,23 +456,126 @@ liftNewRefP p l a = App $ do
 readRef :: Label l => Ref l a -> Enclave l p a
 readRef (LIORef l ref) = do
   taint l
-  Enclave (\_ -> readIORef ref)
+  Enclave (\_ -> verValue <$> readIORef ref)
 
 readRefP :: PrivDesc l p => Priv p -> Ref l a -> Enclave l p a
 readRefP p (LIORef l ref) = do
   taintP p l
-  Enclave (\_ -> readIORef ref)
+  Enclave (\_ -> verValue <$> readIORef ref)
+
+-- | The snapshot together with its version, which grows by one per write.
+readRefVersion :: Label l => Ref l a -> Enclave l p (Word64, a)
+readRefVersion (LIORef l ref) = do
+  taint l
+  Enclave (\_ -> (\(Version n a) -> (n, a)) <$> readIORef ref)
 
 
 writeRef :: Label l => Ref l a -> a -> Enclave l p ()
 writeRef (LIORef l ref) v = do
   guardAlloc l
-  Enclave (\_ -> writeIORef ref v)
+  Enclave (\_ -> publish ref (const v))
 
 writeRefP :: PrivDesc l p => Priv p -> Ref l a -> a -> Enclave l p ()
 writeRefP p (LIORef l ref) v = do
   guardAllocP p l
-  Enclave (\_ -> writeIORef ref v)
+  Enclave (\_ -> publish ref (const v))
+
+-- | Reads and writes the reference, so it taints and checks the write.
+modifyRef :: Label l => Ref l a -> (a -> a) -> Enclave l p ()
+modifyRef (LIORef l ref) f = do
+  taint l
+  guardAlloc l
+  Enclave (\_ -> publish ref f)
+
+modifyRefP :: PrivDesc l p => Priv p -> Ref l a -> (a -> a) -> Enclave l p ()
+modifyRefP p (LIORef l ref) f = do
+  taintP p l
+  guardAllocP p l
+  Enclave (\_ -> publish ref f)
+
+
+{-@ A map whose entries carry labels of their own. The map's label
+    guards the key set: lookups and key listings taint with it, adding
+    or removing keys must be allowed to flow to it. Values are guarded
+    per entry, so reading one user's entry taints with that entry's
+    label only, and an entry is overwritten only if the current label
+    flows to the label it had. The map is a `Data.Map` published through
+    the same versioning as `Ref`: O(log n) per operation, one atomic
+    swap per update, O(1) snapshots for readers.
+@-}
+data LabeledMap l k v = LabeledMap !l (IORef (Version (M.Map k (Labeled l v))))
+
+newLabeledMap :: Label l => l -> Enclave l p (LabeledMap l k v)
+newLabeledMap l = do
+  guardAlloc l
+  Enclave $ \_ -> LabeledMap l <$> newVersioned M.empty
+
+liftNewLabeledMap :: Label l => l -> App (Enclave l p (LabeledMap l k v))
+liftNewLabeledMap l = App $ do
+  r <- liftIO $ newVersioned M.empty
+  return $ do
+    guardAlloc l
+    return (LabeledMap l r)
+
+-- | Taints with the map's label and, if present, the entry's.
+lookupLabeledMap :: (Label l, Ord k) => LabeledMap l k v -> k -> Enclave l p (Maybe v)
+lookupLabeledMap lmap k = lookupLabeledMapLabeled lmap k >>= traverse unlabel
+
+-- | The entry still labeled; taints with the map's label only.
+lookupLabeledMapLabeled :: (Label l, Ord k)
+                        => LabeledMap l k v -> k -> Enclave l p (Maybe (Labeled l v))
+lookupLabeledMapLabeled (LabeledMap ml ref) k = do
+  taint ml
+  Enclave $ \_ -> M.lookup k . verValue <$> readIORef ref
+
+insertLabeledMap :: (Label l, Binary l, Binary v, Ord k)
+                 => LabeledMap l k v -> k -> l -> v -> Enclave l p ()
+insertLabeledMap lmap@(LabeledMap ml _) k l v = do
+  guardAlloc ml
+  guardAlloc l
+  updateEntry lmap k (const (Right (Just (LabeledTCB l v))))
+
+-- | Update one entry in place, keeping its label; a missing key is left
+-- alone. The caller learns nothing about the value, so only the key
+-- set is read. Fails with `LabeledDecodeError`, leaving the map as it
+-- was, if the entry's bytes do not decode.
+adjustLabeledMap :: (Label l, Ord k) => LabeledMap l k v -> k -> (v -> v) -> Enclave l p ()
+adjustLabeledMap lmap@(LabeledMap ml _) k f = do
+  taint ml
+  updateEntry lmap k (traverse adjust)
+  where
+    -- the new value is not raw; matching brings its Binary instance
+    adjust (LabeledTCB l v)            = Right (LabeledTCB l (f v))
+    adjust (LabeledRawTCB l _ decoded) =
+      either (Left . LabeledDecodeError) (Right . LabeledTCB l . f) decoded
+
+deleteLabeledMap :: (Label l, Ord k) => LabeledMap l k v -> k -> Enclave l p ()
+deleteLabeledMap lmap@(LabeledMap ml _) k = do
+  guardAlloc ml
+  updateEntry lmap k (const (Right Nothing))
+
+labeledMapKeys :: Label l => LabeledMap l k v -> Enclave l p [k]
+labeledMapKeys (LabeledMap ml ref) = do
+  taint ml
+  Enclave $ \_ -> M.keys . verValue <$> readIORef ref
+
+-- | Atomically replace the entry at `k`, provided the current label may
+-- write to the entry being replaced. If `f` fails the map, and its
+-- version, stay as they were and the error is thrown.
+updateEntry :: (Label l, Ord k)
+            => LabeledMap l k v -> k
+            -> (Maybe (Labeled l v) -> Either LabeledDecodeError (Maybe (Labeled l v)))
+            -> Enclave l p ()
+updateEntry (LabeledMap _ ref) k f = do
+  LIOState { lioLabel = l_cur } <- getLIOStateTCB
+  (denied, failed) <- Enclave $ \_ -> atomicModifyIORef' ref $ \ver@(Version n m) ->
+    case M.lookup k m of
+      Just old | not (l_cur `canFlowTo` labelOf old) -> (ver, (Just (labelOf old), Nothing))
+      old -> case f old of
+        Left err  -> (ver, (Nothing, Just err))
+        Right new -> (Version (n + 1) (M.alter (const new) k m), (Nothing, Nothing))
+  forM_ denied $ \l -> error ("Can't flow to " <> (show l))
+  forM_ failed $ \err -> Enclave $ \_ -> throwIO err
 
 
 -- | The main monad type alias to use for 'LIO' computations that are
@@ -401,7 +644,8 @@ clientUnLabel _ = ClientDummy
 inEnclave :: (Securable a, Label l, Typeable p) => LIOState l p -> a -> App (Secure a)
 inEnclave initState f = App $ do
   (next_id, remotes, ident) <- get
-  put (next_id + 1, (next_id, \bs -> mkSecure initState f bs) : remotes, ident)
+  let entry = MethodEntry (securableSig f) (\bs -> mkSecure initState f bs)
+  put (next_id + 1, (next_id, entry) : remotes, ident)
   return SecureDummy
 
 
@@ -409,12 +653,310 @@ inEnclave initState f = App $ do
 (<@>) = error "Access to client not allowed"
 
 
+{-@ Streaming calls
+
+    A sink or a source is registered like any other method and every
+    stream message is an ordinary call to its CallID (see `StreamMsg`),
+    so it passes the scheduler and, over RA-TLS, the integrity check
+    like any other call. The client keeps one connection for the stream.
+
+    Sink: a push carries its records back to back in the dictionary
+    coding of `LabelCodec`, whose state lives with the stream, so a
+    label is sent and decoded once per stream. Each record is checked
+    against the stream's clearance on arrival and buffered; a thread of its own feeds the buffer to the
+    sink function in one LIO session for the whole stream. Acks carry
+    the credit left in the buffer (`streamWindow`), and pushing more
+    than that fails the stream. An IFC error raised by the sink fails
+    the stream and is reported on the next message. `StreamEnd` closes
+    the stream and answers `StreamClosed` once the buffer has drained and
+    the final label check of `runLIO` has passed; until then it answers
+    an ack and the client sends it again.
+
+    Source: the method runs on its own thread and each chunk it emits is
+    checked against the output label before the chunk is buffered,
+    blocking while `streamWindow` chunks wait. `StreamPull` hands out
+    what is buffered, possibly nothing. The final label check runs when
+    the method returns.
+
+    No stream message waits for the enclave side, since each one holds
+    a scheduler worker while it is handled.
+
+    Streams untouched for `streamIdleTimeout` are dropped.
+@-}
+
+data SecureSink a = SecureSinkDummy
+
+data SecureSource b = SecureSourceDummy
+
+streamWindow :: Int
+streamWindow = 256
+
+streamIdleTimeout :: Word64
+streamIdleTimeout = 60 * 1000 * 1000 * 1000 -- 60 seconds in nanoseconds
+
+data StreamBuf a = StreamBuf { sbItems  :: !(Seq a)
+                             , sbClosed :: !Bool -- ^ No more items will be added
+                             }
+
+data Stream c a = Stream { stBuffer   :: MVar (StreamBuf a)
+                         , stReadable :: MVar () -- ^ Signalled on new items or close
+                         , stWritable :: MVar () -- ^ Signalled when items are taken
+                         , stResult   :: MVar (Either String ()) -- ^ Enclave side done
+                         , stTouched  :: IORef Word64
+                         , stCodec    :: MVar c -- ^ Decoder state carried across pushes
+                         }
+
+type StreamTable c a = IORef (M.Map StreamID (Stream c a))
+
+signal :: MVar () -> IO ()
+signal v = void (tryPutMVar v ())
+
+openStream :: c -> StreamTable c a -> IO (StreamID, Stream c a)
+openStream codec table = do
+  reapStreams table
+  st  <- Stream <$> newMVar (StreamBuf Seq.empty False)
+                <*> newEmptyMVar <*> newEmptyMVar <*> newEmptyMVar
+                <*> (getMonotonicTimeNSec >>= newIORef) <*> newMVar codec
+  -- unguessable, so one caller cannot push into another's stream
+  sid <- decode . BL.fromStrict <$> (getRandomBytes 8 :: IO B.ByteString)
+  atomicModifyIORef' table $ \m -> (M.insert sid st m, ())
+  bumpStat "stream.opened" 1
+  return (sid, st)
+
+withStream :: StreamTable c a -> StreamID -> (Stream c a -> IO StreamReply)
+           -> IO StreamReply
+withStream table sid k = do
+  found <- M.lookup sid <$> readIORef table
+  case found of
+    Nothing -> return (StreamFailed "Unknown stream")
+    Just st -> do
+      getMonotonicTimeNSec >>= writeIORef (stTouched st)
+      k st
+
+-- | Forget a stream and drop whatever it still buffers.
+dropStream :: StreamTable c a -> StreamID -> Stream c a -> IO ()
+dropStream table sid st = do
+  atomicModifyIORef' table $ \m -> (M.delete sid m, ())
+  modifyMVar_ (stBuffer st) $ \_ -> return (StreamBuf Seq.empty True)
+  signal (stReadable st)
+  signal (stWritable st)
+
+reapStreams :: StreamTable c a -> IO ()
+reapStreams table = do
+  now     <- getMonotonicTimeNSec
+  streams <- M.toList <$> readIORef table
+  forM_ streams $ \(sid, st) -> do
+    touched <- readIORef (stTouched st)
+    when (now - touched > streamIdleTimeout) $ do
+      bumpStat "stream.reaped" 1
+      dropStream table sid st
+
+closeStream :: Stream c a -> IO ()
+closeStream st = do
+  modifyMVar_ (stBuffer st) $ \b -> return b { sbClosed = True }
+  signal (stReadable st)
+
+-- | Sink side; never blocks. Nothing if `xs` exceeds the credit.
+pushItems :: Stream c a -> [a] -> IO (Maybe Int)
+pushItems st xs = do
+  credit <- modifyMVar (stBuffer st) $ \b -> do
+    let free = streamWindow - Seq.length (sbItems b)
+    if length xs > free || sbClosed b
+    then return (b, Nothing)
+    else return (b { sbItems = sbItems b <> Seq.fromList xs }, Just (free - length xs))
+  unless (null xs) $ signal (stReadable st)
+  return credit
+
+-- | Blocks for the next item; Nothing once closed and drained.
+takeItem :: Stream c a -> IO (Maybe a)
+takeItem st = do
+  next <- modifyMVar (stBuffer st) $ \b ->
+    case Seq.viewl (sbItems b) of
+      x :< rest           -> return (b { sbItems = rest }, Just (Just x))
+      EmptyL | sbClosed b -> return (b, Just Nothing)
+             | otherwise  -> return (b, Nothing)
+  case next of
+    Just item -> signal (stWritable st) >> return item
+    Nothing   -> takeMVar (stReadable st) >> takeItem st
+
+-- | Source side; blocks while the buffer is full. False once dropped.
+putItem :: Stream c a -> a -> IO Bool
+putItem st x = do
+  added <- modifyMVar (stBuffer st) $ \b ->
+    if sbClosed b
+    then return (b, Just False)
+    else if Seq.length (sbItems b) >= streamWindow
+    then return (b, Nothing)
+    else return (b { sbItems = sbItems b |> x }, Just True)
+  case added of
+    Just ok -> signal (stReadable st) >> return ok
+    Nothing -> takeMVar (stWritable st) >> putItem st x
+
+-- | Up to n buffered items and whether the stream is finished; never
+-- blocks.
+pullItems :: Stream c a -> Int -> IO ([a], Bool)
+pullItems st n = do
+  r <- modifyMVar (stBuffer st) $ \b -> do
+    let (now, rest) = Seq.splitAt n (sbItems b)
+    return (b { sbItems = rest }, (toList now, sbClosed b && Seq.null rest))
+  unless (null (fst r)) $ signal (stWritable st)
+  return r
+
+runEnclaveTCB :: Enclave l p a -> IORef (LIOState l p) -> IO a
+runEnclaveTCB (Enclave m) = m
+
+-- | The check `runLIO` applies when a call returns.
+finalLabelCheck :: Label l => LIOState l p -> IORef (LIOState l p) -> IO ()
+finalLabelCheck s0 sp = do
+  s1 <- readIORef sp
+  unless ((lioLabel s1) `canFlowTo` (lioOutLabel s0)) $
+    throwIO $ WriteOutException $ "Data cannot flow from " <> (show (lioLabel s1))
+                               <> " to public channel labeled " <> (show (lioOutLabel s0))
+
+streamMethod :: (StreamMsg -> IO StreamReply) -> Method
+streamMethod handler args = Just . encode <$>
+  case args of
+    [arg] | Right (_, _, msg) <- decodeOrFail arg -> handler msg
+    _ -> return (StreamFailed "Malformed stream message")
+
+inEnclaveSink :: forall l p a. (Label l, LabelCodec l, Binary a, Typeable l, Typeable a)
+              => LIOState l p -> (Labeled l a -> Enclave l p ())
+              -> App (SecureSink (Labeled l a))
+inEnclaveSink s0 sink = App $ do
+  table <- liftIO $ newIORef M.empty
+  (next_id, remotes, ident) <- get
+  let entry = MethodEntry (streamSig (Proxy :: Proxy (SecureSink (Labeled l a))))
+                          (streamMethod (sinkHandler s0 sink table))
+  put (next_id + 1, (next_id, entry) : remotes, ident)
+  return SecureSinkDummy
+
+sinkHandler :: (Label l, LabelCodec l, Binary a)
+            => LIOState l p -> (Labeled l a -> Enclave l p ())
+            -> StreamTable (LabelDecoder l) (Labeled l a) -> StreamMsg -> IO StreamReply
+sinkHandler s0 sink table msg =
+  case msg of
+    StreamOpen -> do
+      (sid, st) <- openStream emptyLabelDecoder table
+      _ <- forkIO (sinkWorker s0 sink st)
+      return (StreamAck sid streamWindow)
+    StreamPush sid recs -> withStream table sid $ \st -> do
+      failed  <- tryReadMVar (stResult st)
+      -- records arrive in order, each push extending the stream's dictionary
+      decoded <- modifyMVar (stCodec st) $ \dec -> return $
+        either (\err -> (dec, Left err)) (fmap Right) (decodeLabeledBatch dec recs)
+      case (failed, decoded) of
+        (Just (Left err), _) -> failWith sid st err
+        (_, Left err)        -> failWith sid st err
+        (_, Right xs)
+          | any (not . (`canFlowTo` lioClearance s0) . labelOf) xs ->
+              failWith sid st "Record labeled above the stream's clearance"
+          | otherwise -> do
+              credit <- pushItems st xs
+              case credit of
+                Nothing -> failWith sid st "Pushed more than the granted credit"
+                Just c  -> do
+                  bumpStat "stream.records" (length xs)
+                  return (StreamAck sid c)
+    StreamEnd sid -> withStream table sid $ \st -> do
+      closeStream st
+      done <- tryReadMVar (stResult st)
+      case done of
+        -- still draining; the client asks again
+        Nothing     -> return (StreamAck sid 0)
+        Just result -> do
+          dropStream table sid st
+          return $ either StreamFailed (const StreamClosed) result
+    StreamPull _ _ -> return (StreamFailed "Not a source")
+  where
+    failWith sid st err = do
+      bumpStat "stream.failed" 1
+      dropStream table sid st
+      return (StreamFailed err)
+
+sinkWorker :: Label l
+           => LIOState l p -> (Labeled l a -> Enclave l p ()) -> Stream c (Labeled l a)
+           -> IO ()
+sinkWorker s0 sink st = do
+  sp <- newIORef s0
+  let loop = do
+        next <- takeItem st
+        case next of
+          Nothing -> return ()
+          Just x  -> runEnclaveTCB (sink x) sp >> loop
+  r <- try (loop >> finalLabelCheck s0 sp)
+  putMVar (stResult st) (either (\(e :: SomeException) -> Left (show e)) Right r)
+  -- after a failure nothing drains the buffer any more
+  modifyMVar_ (stBuffer st) $ \_ -> return (StreamBuf Seq.empty True)
+
+inEnclaveSource :: forall l p b. (Label l, Binary b, Typeable b)
+                => LIOState l p -> ((b -> Enclave l p ()) -> Enclave l p ())
+                -> App (SecureSource b)
+inEnclaveSource s0 produce = App $ do
+  table <- liftIO $ newIORef M.empty
+  (next_id, remotes, ident) <- get
+  let entry = MethodEntry (streamSig (Proxy :: Proxy (SecureSource b)))
+                          (streamMethod (sourceHandler s0 produce table))
+  put (next_id + 1, (next_id, entry) : remotes, ident)
+  return SecureSourceDummy
+
+sourceHandler :: (Label l, Binary b)
+              => LIOState l p -> ((b -> Enclave l p ()) -> Enclave l p ())
+              -> StreamTable () ByteString -> StreamMsg -> IO StreamReply
+sourceHandler s0 produce table msg =
+  case msg of
+    StreamOpen -> do
+      (sid, st) <- openStream () table
+      _ <- forkIO (sourceWorker s0 produce st)
+      return (StreamAck sid 0)
+    StreamPull sid n -> withStream table sid $ \st -> do
+      (chunks, finished) <- pullItems st (max 1 (min n streamWindow))
+      bumpStat "stream.chunks" (length chunks)
+      if not finished
+      then return (StreamChunks chunks False)
+      else do
+        result <- readMVar (stResult st)
+        dropStream table sid st
+        return $ either StreamFailed (const (StreamChunks chunks True)) result
+    StreamEnd sid -> withStream table sid $ \st -> do
+      dropStream table sid st
+      return StreamClosed
+    StreamPush _ _ -> return (StreamFailed "Not a sink")
+
+sourceWorker :: (Label l, Binary b)
+             => LIOState l p -> ((b -> Enclave l p ()) -> Enclave l p ())
+             -> Stream () ByteString -> IO ()
+sourceWorker s0 produce st = do
+  sp <- newIORef s0
+  r  <- try (runEnclaveTCB (produce emit) sp >> finalLabelCheck s0 sp)
+  putMVar (stResult st) (either (\(e :: SomeException) -> Left (show e)) Right r)
+  closeStream st
+  where
+    emit b = Enclave $ \sp -> do
+      s <- readIORef sp
+      unless ((lioLabel s) `canFlowTo` (lioOutLabel s)) $
+        throwIO $ WriteOutException $ "Cannot yield at label " <> (show (lioLabel s))
+      chunk <- evaluate (BL.toStrict (encode b))
+      added <- putItem st (BL.fromStrict chunk)
+      unless added $ throwIO (userError "Stream cancelled")
+
+
 class Securable a where
   mkSecure :: (Label l, Typeable p)
            => LIOState l p -> a -> ([ByteString] -> IO (Maybe ByteString))
+  -- | Argument types, then the result type (see `MethodSig`)
+  securableTypes :: Proxy a -> [TypeRep]
+
+securableSig :: forall a. Securable a => a -> MethodSig
+securableSig _ = methodSig (securableTypes (Proxy :: Proxy a))
+
+-- | A request whose arguments do not decode; it never reaches LIO.
+data MalformedArgument = MalformedArgument deriving Show
 
-instance (Binary a, Label l, Typeable p) => Securable (Enclave l p a) where
+instance Exception MalformedArgument
+
+instance (Binary a, Typeable a, Label l, Typeable p) => Securable (Enclave l p a) where
   mkSecure s m = \_ -> fmap (Just . encode) (evalLIO m (toDyn s))
+  securableTypes _ = [typeRep (Proxy :: Proxy a)]
 
 
 -- m :: Enclave l1 a
@@ -422,8 +964,13 @@ instance (Binary a, Label l, Typeable p) => Securable (Enclave l p a) where
 --   mkSecure :: LIOState l1 -> Enclave l a -> [ByteString] -> IO (Maybe ByteString)
 --   mkSecure s m = \_ -> (fmap (Just . encode) (evalLIO m s))
 
-instance (Binary a, Securable b) => Securable (a -> b) where
-  mkSecure s f = \(x:xs) -> mkSecure s (f $ decode x) xs
+-- | Each argument is decoded in full before the method runs; with a
+-- `Labeled` argument that is only the label (see `LabeledRawTCB`).
+instance (Binary a, Typeable a, Securable b) => Securable (a -> b) where
+  mkSecure s f = \(x:xs) -> case decodeOrFail x of
+    Right (rest, _, a) | BL.null rest -> mkSecure s (f a) xs
+    _                                 -> throwIO MalformedArgument
+  securableTypes _ = typeRep (Proxy :: Proxy a) : securableTypes (Proxy :: Proxy b)
 
 
 -- | Term-level locations.
@@ -447,45 +994,122 @@ gateway _ = ClientDummy
 unsafeOnEnclave :: Binary a => Secure (Enclave l p a) -> Client loc a
 unsafeOnEnclave _ = ClientDummy
 
+streamTo :: (LabelCodec l, Binary a)
+         => SecureSink (Labeled l a) -> [Labeled l a] -> Client loc (Maybe Int)
+streamTo _ _ = ClientDummy
+
+raStreamTo :: (LabelCodec l, Binary a)
+           => SecureSink (Labeled l a) -> [Labeled l a] -> Client loc (Maybe Int)
+raStreamTo _ _ = ClientDummy
+
+streamFrom :: Binary b => SecureSource b -> Client loc [b]
+streamFrom _ = ClientDummy
+
+raStreamFrom :: Binary b => SecureSource b -> Client loc [b]
+raStreamFrom _ = ClientDummy
+
 {-@ The enclave's event loop. @-}
 runApp :: Identifier -> App a -> IO a
-runApp ident (App s) = do
-  (a, (_, vTable, _)) <- runStateT s (initAppState ident)
+runApp = runAppWith defaultSchedConfig
+
+runAppWith :: SchedConfig -> Identifier -> App a -> IO a
+runAppWith cfg ident (App s) = do
+  (a, (_, remotes, _)) <- runStateT s (initAppState ident)
+  let vTable = freezeMethods remotes
+  sched <- newScheduler cfg
+  cap   <- traverse openCapture (schedCapture cfg)
+  conns <- newQSem (max 1 (schedMaxConns cfg))
   {- BLOCKING HERE -}
-  _ <- serve (Host localhost) connectPort $
-    \(connectionSocket, remoteAddr) -> do
-      -- debug log
-      putStrLn $ "TCP connection established from " ++ show remoteAddr
-      hFlush stdout -- Gramine prints only if stdout is flushed
-      req <- readTCPSocket connectionSocket
-      onEvent vTable req connectionSocket
+  _ <- listen (Host localhost) connectPort $ \(lsock, _) -> do
+    NS.listen lsock (schedBacklog cfg)
+    forever $ do
+      -- past the connection cap, new clients wait in the listen backlog
+      waitQSem conns
+      void (acceptFork lsock $ \(connectionSocket, remoteAddr) -> do
+              -- debug log
+              putStrLn $ "TCP connection established from " ++ show remoteAddr
+              hFlush stdout -- Gramine prints only if stdout is flushed
+              peer <- peerAddress remoteAddr
+              serveFrames sched cap vTable peer connectionSocket
+                `finally` signalQSem conns)
+        `onException` signalQSem conns
   {- BLOCKING ENDS -}
   return a -- the a is irrelevant
 
 
 
-onEvent :: [(CallID, Method)] -> ByteString -> Socket -> IO ()
-onEvent mapping incoming socket = do
-  let (identifier, args) = decode incoming :: (CallID, [ByteString])
-      Just f = lookup identifier mapping
-  result <- encode <$> f args
-  let res = handleVoidTy result -- the () type cannot be sent over wire
-  sendLazy socket (BL.append (msgSize res) res) -- See NOTE 1
-  where
-    msgSize r = encode $ BL.length r
-    handleVoidTy r = if (BL.length r == 0) -- the () type has msg length 0
-                     then encode '\0'
-                     else r
-
--- NOTE 1
--- We do not use `createPayload` because as a first step it
--- encodes the message body to a ByteString. In case of the
--- enclave the `result` is already a ByteString. So it further
--- encodes the ByteString and gives a wrong result.
--- We can modify the `createPayload` function so that depending
--- on the value of some identifier term that we send, it decides
--- to encode or not encode the message body but then the type
--- will become an actual dependent type. (Keep it simple!)
+-- | Numeric host of a socket address, without the port.
+peerAddress :: SockAddr -> IO Peer
+peerAddress addr = do
+  (host, _) <- NS.getNameInfo [NS.NI_NUMERICHOST] True False addr
+  return (fromMaybe (show addr) host)
+
+-- | A connection carries requests until the client closes it; streams
+-- keep one open for their whole lifetime.
+serveFrames :: Scheduler -> Maybe Capture -> MethodTable -> Peer -> Socket -> IO ()
+serveFrames sched cap vTable peer socket = do
+  req <- recvFrame socket
+  case req of
+    Nothing -> return ()
+    Just r  -> do
+      onEvent sched cap vTable peer r socket
+      serveFrames sched cap vTable peer socket
+
+onEvent :: Scheduler -> Maybe Capture -> MethodTable -> Peer -> ByteString -> Socket
+        -> IO ()
+onEvent sched cap mapping peer incoming socket = do
+  res <- case decodeRequest incoming of
+    Nothing  -> return (Rejected, Nothing)
+    Just req -> do
+      -- a failing method must not take the connection, and the streams
+      -- on it, down with it (`runMethod` forces the reply)
+      schedule sched cap mapping peer req `catch` \e -> do
+        putStrLn $ "Caught exception: " ++ show (e :: SomeException)
+        hFlush stdout
+        return (Rejected, Nothing)
+  sendLazy socket (createPayload res)
+
+-- | The arguments stay undecoded: reading a request only slices them out.
+decodeRequest :: ByteString -> Maybe Request
+decodeRequest incoming = case decodeOrFail incoming of
+  Right (rest, _, req) | BL.null rest -> Just req
+  _                                   -> Nothing
+
+-- | Queue a request behind the scheduler; shed or expired requests are
+-- answered with their status and never reach the method. Requests that
+-- do not match the method's signature never take a worker. Only
+-- requests that reach their method are captured, stamped with their
+-- arrival, so a replay runs what the enclave ran.
+schedule :: Scheduler -> Maybe Capture -> MethodTable -> Peer -> Request -> IO Response
+schedule sched cap mapping peer req =
+  case resolveMethod mapping req of
+    Nothing -> rejectRequest
+    Just f  -> do
+      arrival <- getMonotonicTimeNSec
+      res <- submit sched (flowOf (schedConfig sched) peer) $ do
+        forM_ cap $ \c -> captureRequest c arrival req
+        runMethod (reqCallID req) f (reqArgs req)
+      return $ either (\st -> (st, Nothing)) id res
+
+dispatch :: MethodTable -> Request -> IO Response
+dispatch mapping req =
+  maybe rejectRequest (\f -> runMethod (reqCallID req) f (reqArgs req))
+        (resolveMethod mapping req)
+
+rejectRequest :: IO Response
+rejectRequest = do
+  bumpStat "dispatch.rejected" 1
+  return (Rejected, Nothing)
+
+runMethod :: CallID -> Method -> [ByteString] -> IO Response
+runMethod identifier f args = handle (\MalformedArgument -> rejectRequest) $ do
+  result <- measureAlloc ("method." <> show identifier) $ do
+    r <- f args
+    -- the reply is encoded lazily; force it so the allocation is
+    -- charged to the method
+    _ <- evaluate (maybe 0 BL.length r)
+    return r
+  return (Served, result)
 
 
 microsec :: Int -> Int
@@ -497,110 +1121,105 @@ millisec x = (microsec x) * 1000
 sec :: Int -> Int
 sec x = (millisec x) * 1000
 
-foreign import ccall "startServer" startServer
-    :: Ptr CInt -> Ptr CChar -> IO CInt
-
-foreign import ccall "unistd.h usleep"
-  c_usleep :: CUInt -> IO CInt
-
-sleepMilliseconds :: Int -> IO ()
-sleepMilliseconds ms =
-  c_usleep (fromIntegral (ms * 1000)) >> return () -- Convert milliseconds to microseconds
-
--- XXX: not portable;
--- 8 bytes for this machine
--- big-endian order used for the data packets
-byteStrLength :: Ptr CChar -> IO Int
-byteStrLength cptr = go 0 []
-  where
-    go 8 xs = do
-      let (i0:i1:i2:i3:i4:i5:i6:i7:_) = reverse xs
-      let y = (shift i0 56) .|. (shift i1 48) .|. (shift i2 40) .|.
-              (shift i3 32) .|. (shift i4 24) .|. (shift i5 16) .|.
-              (shift i6  8) .|. i7
-      return y
-    go i xs = do
-      cchar <- peekElemOff cptr i
-      go (i + 1) ((fromEnum cchar):xs)
-
-dataPacketSize :: Int
-dataPacketSize = 1024
-
--- Magic number
--- If there are more than 10 retry attempts
--- after catching IFC violations it is not
--- worth attempting anymore.
-retryNum :: Int
-retryNum = 10
-
+-- | Runs the RA-TLS front end (cbits/server.c) until it fails
+foreign import ccall safe "startServer" startServer
+    :: CInt -> CInt -> IO CInt
+
+-- | Blocks until the front end has read a complete request
+foreign import ccall safe "server_next_request" serverNextRequest
+    :: Ptr Word64 -> Ptr (Ptr CChar) -> Ptr CSize -> CString -> IO CInt
+
+foreign import ccall safe "server_post_response" serverPostResponse
+    :: Word64 -> Ptr CChar -> CSize -> IO CInt
+
+{-@ The C front end multiplexes many TLS connections on one epoll loop.
+    Whenever a connection has read a whole request it is queued for
+    Haskell; the pump below picks it up together with an opaque
+    connection id and forks a handler. The handler answers through
+    `server_post_response` with the same id, which wakes the epoll loop
+    to write the reply. How many handlers actually run is bounded by the
+    scheduler, not by the number of connections.
+@-}
 runAppRA :: Identifier -> App a -> IO a
-runAppRA ident (App s) = do
-  (a, (_, vTable, _)) <- runStateT s (initAppState ident)
-  flagptr  <- malloc :: IO (Ptr CInt)
-  dataptr  <- mallocBytes dataPacketSize :: IO (Ptr CChar)
-  poke flagptr 0
-  tid <- myThreadId
-  _   <- forkIO (ffiComp tid flagptr dataptr)
-  loopWithRetry retryNum vTable flagptr dataptr
-  -- result <-
-  --   try (loop vTable flagptr dataptr) :: IO (Either SomeException ())
-  -- case result of
-  --   Left e  -> putStrLn $ "Caught exception : " ++ show e
-  --   Right _ -> putStrLn "Exited loop with C server termination"
-  -- free flagptr
-  -- free dataptr
+runAppRA = runAppRAWith defaultSchedConfig
+
+runAppRAWith :: SchedConfig -> Identifier -> App a -> IO a
+runAppRAWith cfg ident (App s) = do
+  (a, (_, remotes, _)) <- runStateT s (initAppState ident)
+  let vTable = freezeMethods remotes
+  sched <- newScheduler cfg
+  cap   <- traverse openCapture (schedCapture cfg)
+  tid   <- myThreadId
+  _     <- forkIO (ffiComp tid (schedBacklog cfg) (schedMaxConns cfg))
+  alloca $ \idptr -> alloca $ \dptr -> alloca $ \lenptr ->
+    allocaBytes peerBufSize $ \peerptr ->
+    pump sched cap vTable idptr dptr lenptr peerptr
   return a
   where
-    loopWithRetry :: Int -> [(CallID, Method)] -> Ptr CInt -> Ptr CChar -> IO ()
-    loopWithRetry 0 _ fptr dptr = do
-      putStrLn "Too many retries; killing application"
-      free fptr
-      free dptr
-    loopWithRetry n vTable fptr dptr =
-      loop vTable fptr dptr `catch` handler
-      where
-        handler :: IFCException -> IO ()
-        handler (WriteOutException str) = do
-          putStrLn $ "Caught IFCException: " ++ str
-          -- Resetting flag ptr and data ptr
-          poke fptr 0
-          memsetToZero dptr dataPacketSize
-          putStrLn "Retrying..."
-          -- Retry the loop
-          loopWithRetry (n - 1) vTable fptr dptr
-
-    loop :: [(CallID, Method)] -> Ptr CInt -> Ptr CChar -> IO ()
-    loop vTable fptr dptr = do
-      int_val <- peek fptr
-      if (fromEnum int_val == 0)
-      then do
-        -- threadDelay (millisec 200)
-        -- sleepMilliseconds will force the whole thread to sleep
-        -- instead of context switching (like threadDelay); it is
-        -- a greasy hack to counter for the lack of timing APIs in Intel SGX
-        sleepMilliseconds 200
-        loop vTable fptr dptr
-      else do
-        -- find size of data to be read
-        l <- byteStrLength dptr
-        -- XXX: not portable 8 bytes for this machine
-        byteString <- B.packCStringLen (dptr `plusPtr` 8, l)
-        -- call the correct function from the lookup table
-        res <- onEventRA vTable (BL.fromStrict byteString)
-        -- clear dptr
-        memsetToZero dptr dataPacketSize
-        -- write result to dptr
-        _ <- B.useAsCStringLen (BL.toStrict res) $ \(resptr, len) -> do
-                memcpy dptr resptr (toEnum len)
-        -- set fptr = 0 and set the C server in motion
-        poke fptr 0
-        -- continue Haskell's event loop
-        loop vTable fptr dptr
-
-
-ffiComp :: ThreadId -> Ptr CInt -> Ptr CChar -> IO ()
-ffiComp tid fptr dptr = do
-  errorcode <- startServer fptr dptr
+    pump :: Scheduler -> Maybe Capture -> MethodTable
+         -> Ptr Word64 -> Ptr (Ptr CChar) -> Ptr CSize -> CString -> IO ()
+    pump sched cap vTable idptr dptr lenptr peerptr = do
+      _      <- serverNextRequest idptr dptr lenptr peerptr
+      connId <- peek idptr
+      reqptr <- peek dptr
+      len    <- peek lenptr
+      peer   <- peekCString peerptr
+      -- the C side malloc'ed the request and handed it over to us
+      req    <- B.packCStringLen (reqptr, fromIntegral len)
+      free reqptr
+      _      <- forkIO $ handleRA sched cap vTable peer connId (BL.fromStrict req)
+      pump sched cap vTable idptr dptr lenptr peerptr
+
+-- | INET6_ADDRSTRLEN, enough for the numeric peer address C writes.
+peerBufSize :: Int
+peerBufSize = 46
+
+postAttempts :: Int
+postAttempts = 3
+
+-- | Failures stay with their request: an IFC violation or any other
+-- exception is logged and answered with `Rejected`. Requests and
+-- responses travel in envelopes (see `Compress`).
+handleRA :: Scheduler -> Maybe Capture -> MethodTable -> Peer -> Word64 -> ByteString
+         -> IO ()
+handleRA sched cap vTable peer connId env = do
+  opened <- openEnvelope env
+  (accepts, res) <- case opened of
+    Left err -> do
+      putStrLn $ "Rejected envelope: " ++ err
+      hFlush stdout
+      return (False, rejected)
+    Right (accepts, req) -> do
+      -- forced inside `catch` so that lazily thrown errors are contained too
+      res <- (onEventRA sched cap vTable peer req >>= evaluate . BL.toStrict) `catch` handler
+      return (accepts, res)
+  sealed <- sealEnvelope compression accepts (BL.fromStrict res)
+  B.useAsCStringLen (BL.toStrict (createFrame sealed)) $ \(resptr, len) ->
+    post resptr (fromIntegral len) postAttempts
+  where
+    -- posting only fails when C is out of memory; the connection waits for
+    -- its reply meanwhile, so retry before giving up on it
+    post resptr len attempts = do
+      rc <- serverPostResponse connId resptr len
+      when (rc /= 0) $ do
+        bumpStat "ra.post_failed" 1
+        if attempts > 1
+        then threadDelay 10000 >> post resptr len (attempts - 1)
+        else do
+          putStrLn $ "Could not post the response for connection " ++ show connId
+          hFlush stdout
+    cfg         = schedConfig sched
+    compression = Compression (schedCompress cfg) (schedCompressMin cfg)
+    rejected    = BL.toStrict $ encode (Rejected, Nothing :: Maybe ByteString)
+    handler :: SomeException -> IO B.ByteString
+    handler e = do
+      putStrLn $ "Caught exception: " ++ show e
+      hFlush stdout
+      return rejected
+
+ffiComp :: ThreadId -> Int -> Int -> IO ()
+ffiComp tid backlog maxConns = do
+  errorcode <- startServer (fromIntegral backlog) (fromIntegral maxConns)
   if (fromEnum errorcode /= 0)
   then throwTo tid (userError "C server terminated abnormally")
   else throwTo tid (userError "C server terminated gracefully") -- should not happen
@@ -609,49 +1228,64 @@ gatewayRA :: Binary a => Secure (Enclave l p a) -> Client loc a
 gatewayRA _ = ClientDummy
 
 #ifdef INTEGRITY
-onEventRA :: [(CallID, Method)] -> ByteString -> IO (BL.ByteString)
-onEventRA mapping inmsg = do
+onEventRA :: Scheduler -> Maybe Capture -> MethodTable -> Peer -> ByteString
+          -> IO (BL.ByteString)
+onEventRA sched cap mapping peer inmsg = do
   maybemsg <- sigVerification inmsg
   case maybemsg of
-    Nothing -> do
-      let failedverif = handleVoidTy $ encode ()
-      return (BL.append (msgSize failedverif) failedverif)
-    Just incoming -> do
-      let (identifier, args) = decode incoming :: (CallID, [ByteString])
-          Just f = lookup identifier mapping
-      result <- encode <$> f args
-      let res = handleVoidTy result -- the () type cannot be sent over wire
-      return (BL.append (msgSize res) res)
-  where
-    msgSize r = encode $ BL.length r
-    handleVoidTy r = if (BL.length r == 0) -- the () type has msg length 0
-                     then encode '\0'
-                     else r
+    Nothing -> return $ encode (Rejected, Nothing :: Maybe ByteString)
+    Just incoming -> encode <$> case decodeRequest incoming of
+      Nothing  -> rejectRequest
+      Just req -> schedule sched cap mapping peer req
 #else
-onEventRA :: [(CallID, Method)] -> ByteString -> IO (BL.ByteString)
-onEventRA mapping incoming = do
-  let (identifier, args) = decode incoming :: (CallID, [ByteString])
-      Just f = lookup identifier mapping
-  result <- encode <$> f args
-  let res = handleVoidTy result -- the () type cannot be sent over wire
-  return (BL.append (msgSize res) res)
-  where
-    msgSize r = encode $ BL.length r
-    handleVoidTy r = if (BL.length r == 0) -- the () type has msg length 0
-                     then encode '\0'
-                     else r
+onEventRA :: Scheduler -> Maybe Capture -> MethodTable -> Peer -> ByteString
+          -> IO (BL.ByteString)
+onEventRA sched cap mapping peer incoming =
+  encode <$> case decodeRequest incoming of
+    Nothing  -> rejectRequest
+    Just req -> schedule sched cap mapping peer req
 #endif
 
--- Set all characters in the C string to \0
-memsetToZero :: Ptr CChar -> Int -> IO ()
-memsetToZero ptr len = go ptr 0
-    where
-        go :: Ptr CChar -> Int -> IO ()
-        go p n
-          | n == len = return ()
-          | otherwise = do
-              poke p (fromIntegral (ord '\0') :: CChar)
-              go (p `plusPtr` 1) (n + 1)
+{-@ Offline replay of a trace written with `schedCapture` (see `Capture`).
+
+    Rebuilds the method table of `App` exactly as `runApp` would and
+    feeds the recorded requests straight to `dispatch`, in order, on
+    this thread: no network, no scheduler, no verification. For every
+    request it prints the arrival offset in the trace, the wall time and
+    the bytes allocated; the `Stats` table with the per-method totals is
+    printed at the end. Build with profiling to see where the time goes.
+@-}
+replayApp :: FilePath -- ^ Private key of the trace's `captureKey`
+          -> FilePath -> Identifier -> App a -> IO a
+replayApp keyFile trace ident (App s) = do
+  (a, (_, remotes, _)) <- runStateT s (initAppState ident)
+  let vTable = freezeMethods remotes
+  opener  <- loadOpener keyFile
+  records <- readTrace opener trace
+  let t0 = case records of
+             r : _ -> trTime r
+             []    -> 0
+  putStrLn "#     call  caller      status     offset_ms   time_us   alloc_bytes"
+  forM_ (zip [1 :: Int ..] records) $ \(i, TraceRecord t req) -> do
+    before <- getAllocationCounter -- counts down
+    start  <- getMonotonicTimeNSec
+    (st, _) <- dispatch vTable req `catch` \(e :: SomeException) -> do
+                 putStrLn $ "request " <> show i <> " raised " <> show e
+                 return (Rejected, Nothing)
+    end    <- getMonotonicTimeNSec
+    after  <- getAllocationCounter
+    putStrLn $ unwords [ pad 5 (show i), pad 5 (show (reqCallID req))
+                       , pad 11 (reqCaller req), pad 10 (show st)
+                       , pad 11 (show ((t - t0) `div` 1000000))
+                       , pad 9 (show ((end - start) `div` 1000))
+                       , show (before - after)
+                       ]
+  hFlush stdout
+  runCensus
+  printStats
+  return a
+  where
+    pad n str = str <> replicate (n - length str) ' '
 
 printDecimalValues :: B.ByteString -> IO ()
 printDecimalValues bs = do
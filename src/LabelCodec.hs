@@ -0,0 +1,170 @@
+module LabelCodec (module LabelCodec) where
+
+import Control.Monad (forM_, replicateM)
+import Data.Binary (Binary, get, put)
+import Data.Binary.Get
+import Data.Binary.Put
+import Data.Bits ((.&.), (.|.), shiftL, shiftR, testBit)
+import Data.List (foldl')
+import Data.Sequence (Seq, (|>))
+import Data.Word (Word64)
+
+import App (Labeled(..), labelTCB, labeledRawTCB, payloadTCB)
+import DCLabel
+
+import qualified Data.ByteString.Lazy as BL
+import qualified Data.Map.Strict as M
+import qualified Data.Sequence as Seq
+import qualified Data.Set as S
+
+{-@ Dictionary coding of labeled records
+
+    The `Binary` instance of `Labeled` writes the whole label with
+    every value; for a `DCLabel` that is a set of sets of principal
+    names, often far larger than a small record. A batch of records
+    coded here (a stream pushed into an `inEnclaveSink`) instead
+    carries a label dictionary: the first record with a given label
+    defines it, giving names only for principals not seen before and
+    principal indices otherwise, and later records refer to it by id.
+
+      record := varint 0, varint n, n principal names, label, value
+              | varint (id + 1), value
+      value  := varint length, encoded value
+
+    The decoder keeps every label it has defined, so all records of a
+    batch with the same label share one decoded label object. Values
+    are left raw (see `Labeled`) until they are unlabeled.
+
+@-}
+
+-- | Labels whose principals can be written as dictionary indices.
+class (Ord l, Binary l) => LabelCodec l where
+  labelPrincipals :: l -> [Principal]
+  putLabelWith    :: (Principal -> Word64) -> l -> Put
+  getLabelWith    :: (Word64 -> Get Principal) -> Get l
+
+instance LabelCodec DCLabel where
+  labelPrincipals (DCLabel s i) = cnfPrincipals s ++ cnfPrincipals i
+    where
+      cnfPrincipals (CNF ds) = concatMap (S.toList . dToSet) (S.toList ds)
+
+  putLabelWith index (DCLabel s i) = putCNF s >> putCNF i
+    where
+      putCNF (CNF ds) = do
+        putVarint (fromIntegral $ S.size ds)
+        forM_ (S.toList ds) $ \(Disjunction ps) -> do
+          putVarint (fromIntegral $ S.size ps)
+          mapM_ (putVarint . index) (S.toList ps)
+
+  getLabelWith principalAt = DCLabel <$> getCNF <*> getCNF
+    where
+      getCNF = do
+        n <- getVarint
+        CNF . S.fromList <$> replicateM (fromIntegral n) getDisjunction
+      getDisjunction = do
+        m <- getVarint
+        Disjunction . S.fromList <$> replicateM (fromIntegral m) (getVarint >>= principalAt)
+
+
+data LabelEncoder l = LabelEncoder { encLabels     :: !(M.Map l Word64)
+                                   , encPrincipals :: !(M.Map Principal Word64)
+                                   }
+
+emptyLabelEncoder :: LabelEncoder l
+emptyLabelEncoder = LabelEncoder M.empty M.empty
+
+putLabeledWith :: (LabelCodec l, Binary a)
+               => LabelEncoder l -> Labeled l a -> (LabelEncoder l, Put)
+putLabeledWith enc lv =
+  case M.lookup l (encLabels enc) of
+    Just ref -> (enc, putVarint (ref + 1) >> putValue)
+    Nothing  ->
+      let fresh = foldl' (\new p -> if M.member p (encPrincipals enc) || elem p new
+                                    then new else new ++ [p])
+                         [] (labelPrincipals l)
+          next  = fromIntegral $ M.size (encPrincipals enc)
+          ps    = M.union (encPrincipals enc) (M.fromList (zip fresh [next ..]))
+          ref   = fromIntegral $ M.size (encLabels enc)
+          enc'  = LabelEncoder (M.insert l ref (encLabels enc)) ps
+      in (enc', do putVarint 0
+                   putVarint (fromIntegral $ length fresh)
+                   mapM_ (put . principalName) fresh
+                   putLabelWith (ps M.!) l
+                   putValue)
+  where
+    l        = labelTCB lv
+    bytes    = payloadTCB lv
+    putValue = putVarint (fromIntegral $ BL.length bytes) >> putLazyByteString bytes
+
+-- | Records back to back, sharing (and extending) the dictionary.
+encodeLabeledBatch :: (LabelCodec l, Binary a)
+                   => LabelEncoder l -> [Labeled l a] -> (LabelEncoder l, BL.ByteString)
+encodeLabeledBatch enc0 xs = runPut <$> foldl' step (enc0, return ()) xs
+  where
+    step (enc, acc) x = let (enc', p) = putLabeledWith enc x in (enc', acc >> p)
+
+
+data LabelDecoder l = LabelDecoder { decLabels     :: !(Seq l)
+                                   , decPrincipals :: !(Seq Principal)
+                                   }
+
+emptyLabelDecoder :: LabelDecoder l
+emptyLabelDecoder = LabelDecoder Seq.empty Seq.empty
+
+getLabeledWith :: (LabelCodec l, Binary a)
+               => LabelDecoder l -> Get (LabelDecoder l, Labeled l a)
+getLabeledWith dec = do
+  ref <- getVarint
+  (dec', l) <- if ref == 0 then define else known (ref - 1)
+  n <- getVarint
+  bytes <- getLazyByteString (fromIntegral n)
+  return (dec', labeledRawTCB l bytes)
+  where
+    known i = maybe (fail "Unknown label id") (\l -> return (dec, l))
+                    (Seq.lookup (fromIntegral i) (decLabels dec))
+    define = do
+      n     <- getVarint
+      names <- replicateM (fromIntegral n) get
+      let ps = decPrincipals dec <> Seq.fromList (map Principal names)
+      l <- getLabelWith $ \i ->
+             maybe (fail "Unknown principal id") return (Seq.lookup (fromIntegral i) ps)
+      -- evaluated once here, shared by every record that refers to it
+      l `seq` return (LabelDecoder (decLabels dec |> l) ps, l)
+
+decodeLabeledBatch :: (LabelCodec l, Binary a)
+                   => LabelDecoder l -> BL.ByteString
+                   -> Either String (LabelDecoder l, [Labeled l a])
+decodeLabeledBatch dec0 bytes =
+  case runGetOrFail (go dec0 []) bytes of
+    Left (_, _, err) -> Left err
+    Right (_, _, r)  -> Right r
+  where
+    go dec acc = do
+      done <- isEmpty
+      if done
+      then return (dec, reverse acc)
+      else do
+        (dec', x) <- getLabeledWith dec
+        go dec' (x : acc)
+
+
+-- | LEB128: 7 bits per byte, least significant group first. At most
+-- ten bytes; a longer varint, or a tenth byte with bits beyond the 64th,
+-- is rejected.
+putVarint :: Word64 -> Put
+putVarint n
+  | n < 0x80  = putWord8 (fromIntegral n)
+  | otherwise = putWord8 (fromIntegral (n .&. 0x7f) .|. 0x80) >> putVarint (n `shiftR` 7)
+
+getVarint :: Get Word64
+getVarint = go 0 0
+  where
+    go :: Int -> Word64 -> Get Word64
+    go shift acc = do
+      b <- getWord8
+      let acc' = acc .|. (fromIntegral (b .&. 0x7f) `shiftL` shift)
+      if shift >= 63 && b > 1
+      then fail "Varint too long"
+      else if not (testBit b 7)
+      then return acc'
+      else go (shift + 7) acc'
@@ -0,0 +1,165 @@
+module Mapped (module Mapped) where
+
+import Control.Monad (unless, when)
+import Data.Binary.Get
+import Data.Binary.Put
+import Data.Word (Word64, Word8)
+import Foreign.C
+import Foreign.Marshal.Alloc (alloca)
+import Foreign.Ptr
+import Foreign.Storable (peek)
+
+import Crypto.Cipher.AES (AES256)
+import Crypto.Cipher.Types ( AEADMode(AEAD_GCM), AuthTag(..)
+                           , aeadInit, aeadSimpleDecrypt, aeadSimpleEncrypt)
+import Crypto.Error (eitherCryptoError)
+import Crypto.Hash.Algorithms (SHA256(..))
+import Crypto.PubKey.RSA.Types (PrivateKey, PublicKey)
+
+import Seal
+
+import qualified Crypto.PubKey.RSA.PKCS15 as PKCS15
+import qualified Data.ByteArray as BA
+import qualified Data.ByteString as B
+import qualified Data.ByteString.Char8 as BC
+import qualified Data.ByteString.Lazy as BL
+import qualified Data.ByteString.Unsafe as BU
+
+{-@ Memory-mapped constant datasets
+
+    Large read-only reference data (a password table, a reference panel)
+    is written once, offline, with `writeMapped` and mapped by the
+    enclave with `openMapped`. Opening maps the file, checks the header
+    and unwraps the key: constant work whatever the number of records,
+    and a page is only read in when a record on it is looked up.
+
+      "EIFCMAP2", count n, key length k, RSA-wrapped data key (k bytes)
+      signature length s, writer's signature of all of the above (s bytes)
+      n + 1 record offsets, from the start of the file
+      n records: GCM tag (16 bytes) ++ ciphertext
+
+    Integers are 64-bit big-endian. Every file gets a fresh AES-256 data
+    key, wrapped with RSA-OAEP as in `Seal`. Record i is encrypted under
+    nonce i with (i, n) as associated data, so records cannot be moved
+    or the count changed without failing authentication.
+
+    The wrapping key is public, so anyone could wrap a key of their own
+    and encrypt records under it. The header is therefore signed
+    (RSA PKCS#1 v1.5, SHA-256) with the writer's private key, and
+    `openMapped` checks it against the writer key the enclave trusts
+    before it unwraps anything. The signature covers the count and the
+    wrapped key, and through the key every record. It does not name the
+    dataset: one writer key per dataset keeps a host from swapping in
+    another dataset by the same writer.
+@-}
+
+mappedMagic :: B.ByteString
+mappedMagic = BC.pack "EIFCMAP2"
+
+data MappedFile = MappedFile { mfBytes  :: !B.ByteString -- ^ The whole mapping
+                             , mfCount  :: !Int
+                             , mfIndex  :: !Int -- ^ Offset of the first record offset
+                             , mfCipher :: !AES256
+                             }
+
+foreign import ccall unsafe "map_file" c_map_file
+    :: CString -> Ptr CSize -> IO (Ptr Word8)
+
+foreign import ccall unsafe "unmap_file" c_unmap_file
+    :: Ptr Word8 -> CSize -> IO ()
+
+-- | No copy: the bytes are the mapping, unmapped when they are collected.
+mapFile :: FilePath -> IO B.ByteString
+mapFile path = withCString path $ \cpath -> alloca $ \lenptr -> do
+  addr <- c_map_file cpath lenptr
+  len  <- peek lenptr
+  when (addr == nullPtr) $ ioError (userError ("Mapped: cannot map " <> path))
+  BU.unsafePackCStringFinalizer addr (fromIntegral len) (c_unmap_file addr len)
+
+-- | `writer` is the key of the only party trusted to write the dataset.
+openMapped :: PublicKey -> Opener -> FilePath -> IO MappedFile
+openMapped writer opener path = do
+  bytes <- mapFile path
+  case runGetOrFail (header bytes) (BL.fromStrict bytes) of
+    Left (_, _, err) -> failWith err
+    Right (_, used, (n, wrapped, signed, sig)) -> do
+      unless (PKCS15.verify (Just SHA256) writer signed sig) $
+        failWith "header not signed by the trusted writer"
+      let index = fromIntegral used
+      when (n < 0 || B.length bytes < index + 8 * (n + 1)) $ failWith "truncated index"
+      cipher <- openerDataKey opener wrapped >>= either failWith return
+      return (MappedFile bytes n index cipher)
+  where
+    failWith err = ioError $ userError ("Mapped: " <> path <> ": " <> err)
+    header bytes = do
+      magic <- getByteString (B.length mappedMagic)
+      unless (magic == mappedMagic) $ fail "not a mapped dataset"
+      n <- getWord64be
+      k <- getWord64be
+      wrapped <- getByteString =<< getLength k
+      sig <- getByteString =<< getLength =<< getWord64be
+      return (fromIntegral n, wrapped, signedHeader n wrapped, sig)
+      where
+        -- lengths come from the host; bound them before they size a read
+        getLength len = do
+          used <- bytesRead
+          when (len > fromIntegral (B.length bytes) - fromIntegral used) $ fail "truncated header"
+          return (fromIntegral len)
+
+-- | The part of the header the writer signs.
+signedHeader :: Word64 -> B.ByteString -> B.ByteString
+signedHeader n wrapped = BL.toStrict $ runPut $ do
+  putByteString mappedMagic
+  putWord64be n
+  putWord64be (fromIntegral (B.length wrapped))
+  putByteString wrapped
+
+-- | Decrypts record i, touching only the pages it and its offsets are on.
+mappedRecord :: MappedFile -> Int -> Either String B.ByteString
+mappedRecord (MappedFile bytes n index cipher) i
+  | i < 0 || i >= n = Left "Mapped: record out of range"
+  | otherwise = do
+      let start = offsetAt i
+          end   = offsetAt (i + 1)
+      unless (0 <= start && start + tagSize <= end && end <= B.length bytes) $
+        Left "Mapped: corrupt record offsets"
+      let (tag, body) = B.splitAt tagSize (B.take (end - start) (B.drop start bytes))
+      aead <- either (Left . show) Right $
+                eitherCryptoError (aeadInit AEAD_GCM cipher (recordNonce i))
+      maybe (Left "Mapped: authentication failed") Right $
+        aeadSimpleDecrypt aead (recordAAD i n) body (AuthTag $ BA.convert tag)
+  where
+    offsetAt j = B.foldl' (\acc b -> acc * 256 + fromIntegral b) 0
+                          (B.take 8 (B.drop (index + 8 * j) bytes))
+
+recordNonce :: Int -> B.ByteString
+recordNonce i = BL.toStrict $ runPut $ putWord32be 0 >> putWord64be (fromIntegral i)
+
+recordAAD :: Int -> Int -> B.ByteString
+recordAAD i n = BL.toStrict $ runPut $ putWord64be (fromIntegral i) >> putWord64be (fromIntegral n)
+
+-- | The offline writer; `writerK` signs the header and `pubK` is the key
+-- the enclave opens with. All records are held in memory while the file
+-- is written.
+writeMapped :: PrivateKey -> PublicKey -> FilePath -> [B.ByteString] -> IO ()
+writeMapped writerK pubK path records = do
+  DataKey cipher wrapped <- newSealer pubK >>= sealerDataKey -- fresh key per file
+  let n      = length records
+      signed = signedHeader (fromIntegral n) wrapped
+  sig <- either (ioError . userError . show) return $
+           PKCS15.sign Nothing (Just SHA256) writerK signed
+  sealed <- mapM (sealRecord cipher n) (zip [0 ..] records)
+  let index   = B.length signed + 8 + B.length sig
+      offsets = scanl (+) (index + 8 * (n + 1)) (map B.length sealed)
+  BL.writeFile path $ runPut $ do
+    putByteString signed
+    putWord64be (fromIntegral (B.length sig))
+    putByteString sig
+    mapM_ (putWord64be . fromIntegral) offsets
+    mapM_ putByteString sealed
+  where
+    sealRecord cipher n (i, plain) = do
+      aead <- either (ioError . userError . show) return $
+                eitherCryptoError (aeadInit AEAD_GCM cipher (recordNonce i))
+      let (tag, body) = aeadSimpleEncrypt aead (recordAAD i n) plain tagSize
+      return (BA.convert tag <> body)
@@ -0,0 +1,241 @@
+{-# LANGUAGE DefaultSignatures #-}
+{-# LANGUAGE GADTs #-}
+{-# LANGUAGE ScopedTypeVariables #-}
+
+module Memory (module Memory) where
+
+import Control.Concurrent (forkIO, threadDelay)
+import Control.Exception (SomeException, try)
+import Control.Monad (void, when)
+import Data.Binary (Binary, encode)
+import Data.IORef
+import Data.Maybe (catMaybes, isJust)
+import Data.Word (Word8, Word64)
+import GHC.Clock (getMonotonicTimeNSec)
+import GHC.Conc (getAllocationCounter)
+import GHC.Stats
+import System.Mem (performMajorGC)
+import System.IO.Unsafe (unsafePerformIO)
+
+import App (Labeled(..))
+import DCLabel (DCLabel)
+import Stats
+
+import qualified Data.ByteString as B
+import qualified Data.ByteString.Lazy as BL
+import qualified Data.Map.Strict as M
+
+{-@ Memory accounting for enclave state
+
+    Once the enclave's working set outgrows the EPC every access pages
+    through encrypted memory, so we keep the heap in view:
+
+    - per method: bytes allocated and number of calls, from the
+      allocation counter of the thread that ran the call
+      ("method.<id>.alloc_bytes", "method.<id>.calls");
+    - per reference: approximate retained size of the contents of refs
+      created with `liftNewRefSized` ("mem.ref.<name>"), computed by
+      `Footprint`; labeled constants are summed in "mem.constants";
+    - the RTS view after the last GC: "mem.live_bytes",
+      "mem.heap_bytes", "mem.max_live_bytes". These need `+RTS -T`.
+
+    With a budget set, a background thread refreshes the RTS gauges
+    every `memCheckInterval`, and the per-reference ones, which walk the
+    contents, every `censusEvery` refreshes; a ref is only walked again
+    once it has been written. Crossing the soft budget runs one major
+    GC (compacting with `+RTS -c`) on that thread, then none until live
+    data has dropped well below it, spaced by a growing backoff (see
+    `refreshMemory`). Past the hard budget, after that GC, new requests
+    are answered `Exhausted` until live data drops again.
+    Admission only reads the verdict of the last refresh, so no request
+    waits for a census or a collection.
+
+@-}
+
+wordBytes :: Int
+wordBytes = 8
+
+-- | Approximate heap size in bytes of a fully evaluated value, sharing
+-- ignored. The default goes through the `Binary` encoding, which is
+-- a rough lower bound for flat records.
+class Footprint a where
+  footprint :: a -> Int
+  default footprint :: Binary a => a -> Int
+  footprint = binaryFootprint
+
+binaryFootprint :: Binary a => a -> Int
+binaryFootprint a = 2 * wordBytes + fromIntegral (BL.length (encode a))
+
+instance Footprint () where
+  footprint _ = 0
+
+instance Footprint Bool where
+  footprint _ = 0 -- static closures
+
+instance Footprint Int where
+  footprint _ = 2 * wordBytes
+
+instance Footprint Word8 where
+  footprint _ = 2 * wordBytes
+
+instance Footprint Char where
+  footprint _ = 2 * wordBytes
+
+instance Footprint Double where
+  footprint _ = 2 * wordBytes
+
+instance Footprint B.ByteString where
+  footprint b = 9 * wordBytes + B.length b
+
+instance Footprint BL.ByteString where
+  footprint = BL.foldlChunks (\n c -> n + 3 * wordBytes + footprint c) 0
+
+instance Footprint a => Footprint [a] where
+  footprint = foldr (\x n -> n + 3 * wordBytes + footprint x) 0
+
+instance Footprint a => Footprint (Maybe a) where
+  footprint = maybe 0 (\a -> 2 * wordBytes + footprint a)
+
+instance (Footprint a, Footprint b) => Footprint (a, b) where
+  footprint (a, b) = 3 * wordBytes + footprint a + footprint b
+
+instance (Footprint k, Footprint v) => Footprint (M.Map k v) where
+  footprint = M.foldlWithKey' (\n k v -> n + 6 * wordBytes + footprint k + footprint v) 0
+
+instance (Footprint l, Footprint a) => Footprint (Labeled l a) where
+  footprint (LabeledTCB l a) = 3 * wordBytes + footprint l + footprint a
+  -- the value is not forced: counted as its bytes until unlabeled
+  footprint (LabeledRawTCB l bytes _) = 5 * wordBytes + footprint l + footprint bytes
+
+instance Footprint DCLabel
+
+
+-- | Run an action and charge what the current thread allocated to
+-- "<name>.alloc_bytes". Only meaningful if `action` does its work on
+-- this thread and returns evaluated data.
+measureAlloc :: StatName -> IO a -> IO a
+measureAlloc name action = do
+  before <- getAllocationCounter -- counts down
+  a      <- action
+  after  <- getAllocationCounter
+  bumpStat (name <> ".alloc_bytes") (fromIntegral (before - after))
+  bumpStat (name <> ".calls") 1
+  return a
+
+censusTable :: IORef (M.Map StatName (IO Int))
+censusTable = unsafePerformIO $ newIORef M.empty
+{-# NOINLINE censusTable #-}
+
+-- | Report `size` as the "mem.<name>" gauge on every census.
+registerCensus :: StatName -> IO Int -> IO ()
+registerCensus name size =
+  atomicModifyIORef' censusTable $ \m -> (M.insert name size m, ())
+
+-- | Runs every `censusEvery` refreshes while a budget is set; call it
+-- before `printStats` to have current figures on request.
+runCensus :: IO ()
+runCensus = do
+  entries <- M.toList <$> readIORef censusTable
+  mapM_ (\(name, size) -> size >>= setStat ("mem." <> name)) entries
+
+-- | Live bytes after the last GC, or Nothing without `+RTS -T`.
+sampleMemory :: IO (Maybe Int)
+sampleMemory = do
+  enabled <- getRTSStatsEnabled
+  if not enabled
+  then return Nothing
+  else do
+    st <- getRTSStats
+    let live = fromIntegral (gcdetails_live_bytes (gc st))
+    setStat "mem.live_bytes" live
+    setStat "mem.heap_bytes" (fromIntegral $ gcdetails_mem_in_use_bytes (gc st))
+    setStat "mem.max_live_bytes" (fromIntegral $ max_live_bytes st)
+    return (Just live)
+
+
+memCheckInterval :: Int
+memCheckInterval = 250 * 1000 -- 250 ms in microseconds
+
+-- | Refreshes between two runs of the census, which walks every
+-- registered value: 10 seconds.
+censusEvery :: Int
+censusEvery = 40
+
+-- | Live data has to fall below this share of the budget before a
+-- crossing triggers another major GC.
+gcRearmPercent :: Int
+gcRearmPercent = 90
+
+gcBackoffMin, gcBackoffMax :: Word64
+gcBackoffMin = 1000 * 1000 * 1000       -- 1 second in nanoseconds
+gcBackoffMax = 60 * 1000 * 1000 * 1000  -- 60 seconds in nanoseconds
+
+data MemGuard = MemGuard { mgSoft :: Maybe Int -- ^ live bytes; major GC
+                         , mgHard :: Maybe Int -- ^ live bytes; reject
+                         , mgOver :: IORef Bool -- ^ over hard at the last refresh
+                         }
+
+-- | When the refresh thread may trigger the next major GC.
+data GcState = GcState { gcArmed   :: !Bool   -- ^ fell below the rearm level since the last one
+                       , gcNext    :: !Word64 -- ^ not before this time
+                       , gcBackoff :: !Word64 -- ^ spacing after the next one
+                       }
+
+-- | Starts the thread that refreshes the guard, if a budget is set.
+newMemGuard :: Maybe Int -> Maybe Int -> IO MemGuard
+newMemGuard soft hard = do
+  enabled <- getRTSStatsEnabled
+  when ((isJust soft || isJust hard) && not enabled) $
+    putStrLn "Memory budgets need +RTS -T, not enforced"
+  guard <- MemGuard soft hard <$> newIORef False
+  let loop n gs = do
+        -- a failing census entry must not stop the refreshes
+        when (n `mod` censusEvery == 0) $ do
+          c <- try runCensus
+          case c of
+            Left (e :: SomeException) -> putStrLn $ "Memory census failed: " ++ show e
+            Right ()                  -> return ()
+        r <- try (refreshMemory guard gs)
+        gs' <- case r of
+          Left (e :: SomeException) -> do
+            putStrLn $ "Memory refresh failed: " ++ show e
+            return gs
+          Right (over, gs') -> writeIORef (mgOver guard) over >> return gs'
+        threadDelay memCheckInterval
+        loop (n + 1) gs'
+  when (isJust soft || isJust hard) $
+    void $ forkIO $ loop (0 :: Int) (GcState True 0 gcBackoffMin)
+  return guard
+
+-- | False while live data was above the hard budget at the last refresh.
+admitMemory :: MemGuard -> IO Bool
+admitMemory guard = not <$> readIORef (mgOver guard)
+
+-- | Whether live data is over the hard budget. Crossing a budget runs
+-- one major GC; the next one waits until live data has dropped below
+-- `gcRearmPercent` of the budget and the backoff has passed. Crossings
+-- that follow each other within the backoff double it, up to
+-- `gcBackoffMax`.
+refreshMemory :: MemGuard -> GcState -> IO (Bool, GcState)
+refreshMemory (MemGuard soft hard _) gs = do
+  live <- sampleMemory
+  now  <- getMonotonicTimeNSec
+  case live of
+    Nothing -> return (False, gs)
+    Just bytes
+      | over bytes && gcArmed gs && now >= gcNext gs -> do
+          bumpStat "mem.major_gc" 1
+          performMajorGC
+          after <- sampleMemory
+          return ( maybe False (above hard) after
+                 , GcState False (now + gcBackoff gs) (min gcBackoffMax (2 * gcBackoff gs)) )
+      | over bytes -> return (above hard bytes, gs)
+      | not (gcArmed gs) && below bytes ->
+          -- a calm spell resets the backoff, a quick return keeps it
+          let backoff = if now >= gcNext gs + gcBackoff gs then gcBackoffMin else gcBackoff gs
+          in return (False, gs { gcArmed = True, gcBackoff = backoff })
+      | otherwise -> return (False, gs)
+  where
+    above budget bytes = maybe False (bytes >) budget
+    over bytes = above soft bytes || above hard bytes
+    below bytes = all (\b -> bytes < b * gcRearmPercent `div` 100) (catMaybes [soft, hard])
@@ -0,0 +1,217 @@
+{-# LANGUAGE ScopedTypeVariables #-}
+
+module Scheduler (module Scheduler) where
+
+import Control.Concurrent
+import Control.Exception
+import Control.Monad (forever, replicateM_, when)
+import Data.Sequence (Seq, ViewL(..), (|>))
+import Data.Word (Word64)
+import GHC.Clock (getMonotonicTimeNSec)
+import System.Timeout (timeout)
+
+import App (Identifier, Status(..))
+import Capture (CaptureConfig)
+import Memory
+import Stats
+
+import qualified Data.Map.Strict as M
+import qualified Data.Sequence as Seq
+
+{-@ Admission control and fair scheduling for enclave requests
+
+    Every decoded request is submitted under a flow identity that the
+    transport vouches for: the numeric address of the connection's peer,
+    or the name `schedPeers` gives that address (`org1`, `org2`, ...).
+    The caller named inside a request is self-reported and is never
+    used for scheduling. Admission is bounded twice: globally by
+    `schedCapacity` and per flow by `schedFlowCapacity`. A bulk
+    uploader therefore fills its own share of the queue and is then
+    answered `Busy`, instead of crowding out interactive callers.
+
+    Queued requests are served with start-time fair queuing. Each
+    flow has a weight; a request gets the start tag
+    max(V, F) where F is the finish tag of its flow's previous request,
+    and the flow's finish tag advances by 1/weight. Workers always take
+    the flow whose head has the smallest start tag and set V to it.
+
+    A request that waited longer than `schedDeadline` is answered
+    `Expired` without being run. If `schedTimeout` is set, a request
+    that runs for longer is abandoned and answered `Expired` as well.
+
+    `schedBacklog` and `schedMaxConns` bound both front ends one step
+    earlier: past the connection cap new clients wait in the
+    kernel's listen backlog until a connection closes.
+
+    Before any of that a request has to pass the memory guard (see
+    `Memory`): over `schedHardBudget` it is answered `Exhausted`.
+
+@-}
+
+data SchedConfig =
+  SchedConfig { schedWorkers      :: !Int -- ^ Requests served in parallel
+              , schedCapacity     :: !Int -- ^ Queued requests, all callers
+              , schedFlowCapacity :: !Int -- ^ Queued requests, per flow
+              , schedDeadline     :: !Int -- ^ Max queueing delay (microsec)
+              , schedTimeout      :: !(Maybe Int) -- ^ Max run time (microsec)
+              , schedWeights      :: M.Map Identifier Int -- ^ Per flow, default 1
+              , schedPeers        :: M.Map Peer Identifier -- ^ Flow of a peer address
+              , schedBacklog      :: !Int -- ^ RA-TLS listen backlog
+              , schedMaxConns     :: !Int -- ^ RA-TLS open connection cap
+              , schedSoftBudget   :: !(Maybe Int) -- ^ Live heap bytes, major GC
+              , schedHardBudget   :: !(Maybe Int) -- ^ Live heap bytes, reject
+              , schedCapture      :: !(Maybe CaptureConfig) -- ^ Trace requests
+              , schedCompress     :: !Bool -- ^ Compress RA-TLS messages (see `Compress`)
+              , schedCompressMin  :: !Int  -- ^ Smallest message compressed, bytes
+              }
+
+defaultSchedConfig :: SchedConfig
+defaultSchedConfig =
+  SchedConfig { schedWorkers      = 4
+              , schedCapacity     = 256
+              , schedFlowCapacity = 64
+              , schedDeadline     = 5 * 1000 * 1000 -- 5 seconds
+              , schedTimeout      = Nothing
+              , schedWeights      = M.empty
+              , schedPeers        = M.empty
+              , schedBacklog      = 128
+              , schedMaxConns     = 1024
+              , schedSoftBudget   = Nothing
+              , schedHardBudget   = Nothing
+              , schedCapture      = Nothing
+              , schedCompress     = False
+              , schedCompressMin  = 4096
+              }
+
+-- | Numeric address of a connection's remote end, e.g. "10.0.0.7".
+type Peer = String
+
+-- | Requests from one peer share a flow, named by `schedPeers` or by
+-- the address itself.
+flowOf :: SchedConfig -> Peer -> Identifier
+flowOf cfg peer = M.findWithDefault peer peer (schedPeers cfg)
+
+data Job = Job { jobArrival :: !Word64 -- ^ monotonic nanoseconds
+               , jobRun     :: IO ()
+               , jobReject  :: Status -> IO ()
+               }
+
+data Flow = Flow { flowQueue  :: !(Seq (Double, Job)) -- ^ (start tag, job)
+                 , flowFinish :: !Double
+                 }
+
+data SchedState = SchedState { ssFlows   :: !(M.Map Identifier Flow)
+                             , ssQueued  :: !Int
+                             , ssVirtual :: !Double
+                             }
+
+data Scheduler = Scheduler { schedConfig :: SchedConfig
+                           , schedState  :: MVar SchedState
+                           , schedReady  :: QSem -- ^ one unit per queued job
+                           , schedMemory :: MemGuard
+                           }
+
+newScheduler :: SchedConfig -> IO Scheduler
+newScheduler cfg = do
+  st    <- newMVar (SchedState M.empty 0 0)
+  ready <- newQSem 0
+  mem   <- newMemGuard (schedSoftBudget cfg) (schedHardBudget cfg)
+  let sched = Scheduler cfg st ready mem
+  replicateM_ (max 1 (schedWorkers cfg)) $ forkIO (worker sched)
+  return sched
+
+-- | Run `action` on a worker once the scheduler admits and picks it.
+-- Exceptions thrown by `action` are rethrown in the calling thread.
+submit :: Scheduler -> Identifier -> IO a -> IO (Either Status a)
+submit sched flow action = do
+  reply <- newEmptyMVar
+  now   <- getMonotonicTimeNSec
+  let job = Job { jobArrival = now
+                , jobRun     = runJob (schedTimeout (schedConfig sched)) reply
+                , jobReject  = putMVar reply . Left
+                }
+  fits     <- admitMemory (schedMemory sched)
+  admitted <- if fits then enqueue sched flow job else return False
+  if not fits
+  then do
+    bumpStat "mem.exhausted" 1
+    return (Left Exhausted)
+  else if not admitted
+  then do
+    bumpStat "sched.busy" 1
+    return (Left Busy)
+  else do
+    r <- takeMVar reply
+    case r of
+      Left st                           -> return (Left st)
+      Right (Left (e :: SomeException)) -> throwIO e
+      Right (Right a)                   -> return (Right a)
+  where
+    runJob Nothing reply = do
+      r <- try action
+      putMVar reply (Right r)
+    runJob (Just usec) reply = do
+      r <- try (timeout usec action)
+      case r of
+        Left e         -> putMVar reply (Right (Left e))
+        Right Nothing  -> do
+          bumpStat "sched.timeout" 1
+          putMVar reply (Left Expired)
+        Right (Just a) -> putMVar reply (Right (Right a))
+
+enqueue :: Scheduler -> Identifier -> Job -> IO Bool
+enqueue (Scheduler cfg st ready _) caller job = do
+  admitted <- modifyMVar st $ \s -> do
+    let flow   = M.findWithDefault (Flow Seq.empty 0) caller (ssFlows s)
+        full   = ssQueued s >= schedCapacity cfg
+              || Seq.length (flowQueue flow) >= schedFlowCapacity cfg
+        start  = max (ssVirtual s) (flowFinish flow)
+        finish = start + 1 / fromIntegral (weightOf cfg caller)
+        flow'  = Flow (flowQueue flow |> (start, job)) finish
+    if full
+    then return (s, False)
+    else return (s { ssFlows  = M.insert caller flow' (ssFlows s)
+                   , ssQueued = ssQueued s + 1
+                   }, True)
+  when admitted $ do
+    bumpStat "sched.admitted" 1
+    signalQSem ready
+  return admitted
+
+weightOf :: SchedConfig -> Identifier -> Int
+weightOf cfg caller = max 1 $ M.findWithDefault 1 caller (schedWeights cfg)
+
+-- | Take the queued job with the smallest start tag. Only called after
+-- acquiring a unit of `schedReady`, so the queue is never empty here.
+dequeue :: Scheduler -> IO Job
+dequeue (Scheduler _ st _ _) = modifyMVar st $ \s ->
+  case M.foldrWithKey pick Nothing (ssFlows s) of
+    Nothing -> error "Scheduler woken up with an empty queue"
+    Just (caller, tag, job, rest) -> do
+      -- drained flows are forgotten; they restart at V when they return
+      let flows | Seq.null rest = M.delete caller (ssFlows s)
+                | otherwise     = M.adjust (\f -> f { flowQueue = rest })
+                                           caller (ssFlows s)
+      return (s { ssFlows   = flows
+                , ssQueued  = ssQueued s - 1
+                , ssVirtual = tag
+                }, job)
+  where
+    pick caller flow best =
+      case Seq.viewl (flowQueue flow) of
+        EmptyL -> best
+        (tag, job) :< rest -> case best of
+          Just (_, tag', _, _) | tag' <= tag -> best
+          _ -> Just (caller, tag, job, rest)
+
+worker :: Scheduler -> IO ()
+worker sched = forever $ do
+  waitQSem (schedReady sched)
+  job <- dequeue sched
+  now <- getMonotonicTimeNSec
+  let waited = fromIntegral ((now - jobArrival job) `div` 1000)
+  if waited > schedDeadline (schedConfig sched)
+  then do
+    bumpStat "sched.expired" 1
+    jobReject job Expired
+  else jobRun job
@@ -0,0 +1,161 @@
+module Seal (module Seal) where
+
+import Control.Monad (unless)
+import Data.Binary
+import Data.IORef
+import System.IO.Unsafe (unsafePerformIO)
+
+import Crypto.Cipher.AES (AES256)
+import Crypto.Cipher.Types ( AEADMode(AEAD_GCM), AuthTag(..)
+                           , aeadInit, aeadSimpleDecrypt, aeadSimpleEncrypt
+                           , cipherInit)
+import Crypto.Error (eitherCryptoError)
+import Crypto.Hash.Algorithms (SHA256(..))
+import Crypto.PubKey.RSA.Types (PrivateKey, PublicKey)
+import Crypto.Random (getRandomBytes)
+
+import qualified Crypto.PubKey.RSA.OAEP as OAEP
+import qualified Data.ByteArray as BA
+import qualified Data.ByteString as B
+import qualified Data.Map.Strict as M
+
+{-@ Hybrid sealing of enclave results
+
+    Raw RSA can only encrypt less than a modulus worth of data and costs
+    a private key operation per call on the receiving side. Instead the
+    enclave seals results with AES-256-GCM under a per-recipient data
+    key. The data key is generated on first use, wrapped once with the
+    recipient's RSA key (OAEP) and the wrapped key travels with every
+    `Sealed` value. After `sealsPerKey` results the key is replaced, so
+    random nonces never come near a collision however long the enclave
+    runs.
+
+    The recipient keeps an `Opener` that unwraps each distinct data key
+    once and caches it, so opening a result is a single AEAD decryption.
+
+    enclave:  sealer <- newSealer pubK         -- App, once
+              seal sealer bytes                -- per result
+    client:   opener <- loadOpener "ssl/private.key"
+              unseal opener sealed
+
+@-}
+
+data Sealed = Sealed { sealedKey   :: !B.ByteString -- ^ RSA-wrapped data key
+                     , sealedNonce :: !B.ByteString
+                     , sealedTag   :: !B.ByteString
+                     , sealedBody  :: !B.ByteString
+                     } deriving (Eq, Show)
+
+instance Binary Sealed where
+  put (Sealed k n t b) = put k >> put n >> put t >> put b
+  get = Sealed <$> get <*> get <*> get <*> get
+
+dataKeySize, nonceSize, tagSize :: Int
+dataKeySize = 32 -- AES-256
+nonceSize   = 12 -- 96-bit GCM nonce
+tagSize     = 16
+
+oaepParams :: OAEP.OAEPParams SHA256 B.ByteString B.ByteString
+oaepParams = OAEP.defaultOAEPParams SHA256
+
+data DataKey = DataKey { dkCipher  :: !AES256
+                       , dkWrapped :: !B.ByteString
+                       }
+
+data Sealer = Sealer { sealerPubKey :: PublicKey
+                     , sealerKey    :: IORef (Maybe (DataKey, Int)) -- ^ With the seals it has left
+                     }
+
+-- | Seals under one data key before it is replaced. Nonces are random,
+-- and 2^24 messages keep the chance of a repeated GCM nonce far below
+-- the 2^-32 that NIST SP 800-38D allows.
+sealsPerKey :: Int
+sealsPerKey = 2 ^ (24 :: Int)
+
+-- | Cheap; the data key is only generated and wrapped by the first `seal`.
+newSealer :: PublicKey -> IO Sealer
+newSealer pubK = Sealer pubK <$> newIORef Nothing
+
+-- | The key for one more message; a used up key is replaced by a fresh
+-- one, wrapped again.
+sealerDataKey :: Sealer -> IO DataKey
+sealerDataKey (Sealer pubK ref) = do
+  taken <- atomicModifyIORef' ref $ \cur -> case cur of
+    Just (dk, left) | left > 0 -> (Just (dk, left - 1), Just dk)
+    _                          -> (cur, Nothing)
+  case taken of
+    Just dk -> return dk
+    Nothing -> do
+      key     <- getRandomBytes dataKeySize :: IO B.ByteString
+      wrapped <- OAEP.encrypt oaepParams pubK key
+      case wrapped of
+        Left err -> ioError $ userError ("Seal: wrapping data key failed " <> show err)
+        Right w  -> do
+          dk <- DataKey <$> aesKey key <*> pure w
+          -- racing rotations each use their own fresh key for this message;
+          -- the key of whichever came first stays current
+          atomicModifyIORef' ref $ \cur -> case cur of
+            Just (_, left) | left > 0 -> (cur, dk)
+            _                         -> (Just (dk, sealsPerKey - 1), dk)
+
+seal :: Sealer -> B.ByteString -> IO Sealed
+seal sealer msg = do
+  DataKey cipher wrapped <- sealerDataKey sealer
+  nonce <- getRandomBytes nonceSize :: IO B.ByteString
+  aead  <- either (ioError . userError . show) return $
+             eitherCryptoError (aeadInit AEAD_GCM cipher nonce)
+  let (tag, body) = aeadSimpleEncrypt aead wrapped msg tagSize
+  return $ Sealed wrapped nonce (BA.convert tag) body
+
+
+data Opener = Opener { openerPrivKey :: PrivateKey
+                     , openerKeys    :: IORef (M.Map B.ByteString AES256)
+                     }
+
+newOpener :: PrivateKey -> IO Opener
+newOpener privK = Opener privK <$> newIORef M.empty
+
+-- | Openers are cached per key file, so the key is read and parsed
+-- once per process instead of once per call.
+loadOpener :: FilePath -> IO Opener
+loadOpener path = do
+  cached <- M.lookup path <$> readIORef openerCache
+  case cached of
+    Just opener -> return opener
+    Nothing -> do
+      opener <- read <$> readFile path >>= newOpener
+      atomicModifyIORef' openerCache $ \m ->
+        let m' = M.insertWith (\_ old -> old) path opener m in (m', m' M.! path)
+
+openerCache :: IORef (M.Map FilePath Opener)
+openerCache = unsafePerformIO $ newIORef M.empty
+{-# NOINLINE openerCache #-}
+
+unseal :: Opener -> Sealed -> IO (Either String B.ByteString)
+unseal opener (Sealed wrapped nonce tag body) = do
+  key <- openerDataKey opener wrapped
+  return $ do
+    cipher <- key
+    unless (B.length tag == tagSize) $ Left "Seal: malformed tag"
+    aead   <- either (Left . show) Right $
+                eitherCryptoError (aeadInit AEAD_GCM cipher nonce)
+    maybe (Left "Seal: authentication failed") Right $
+      aeadSimpleDecrypt aead wrapped body (AuthTag $ BA.convert tag)
+
+openerDataKey :: Opener -> B.ByteString -> IO (Either String AES256)
+openerDataKey (Opener privK ref) wrapped = do
+  cached <- M.lookup wrapped <$> readIORef ref
+  case cached of
+    Just cipher -> return (Right cipher)
+    Nothing -> do
+      key <- OAEP.decryptSafer oaepParams privK wrapped
+      case key of
+        Left err -> return $ Left ("Seal: unwrapping data key failed " <> show err)
+        Right k  -> do
+          cipher <- aesKey k
+          atomicModifyIORef' ref $ \m -> (M.insert wrapped cipher m, ())
+          return (Right cipher)
+
+aesKey :: B.ByteString -> IO AES256
+aesKey key = either (ioError . userError . show) return $
+               eitherCryptoError (cipherInit key)
@@ -0,0 +1,93 @@
+module Stats (module Stats) where
+
+import Data.IORef
+import Foreign.Marshal.Array (callocArray)
+import Foreign.Ptr (Ptr)
+import Foreign.Storable (peekElemOff, pokeElemOff)
+import System.IO (hFlush, stdout)
+import System.IO.Unsafe (unsafePerformIO)
+
+import qualified Data.Map.Strict as M
+
+{-@ Runtime statistics
+
+    A process-wide table of named counters. The enclave runtime bumps
+    these from the request path and `statsSnapshot` returns a copy that
+    can be logged or shipped to an operator. Names are dotted paths,
+    e.g. "sched.busy", grouped by the subsystem that owns them.
+
+@-}
+
+type StatName = String
+
+statsTable :: IORef (M.Map StatName Int)
+statsTable = unsafePerformIO $ newIORef M.empty
+{-# NOINLINE statsTable #-}
+
+-- | Add `n` to a counter, creating it at 0 if needed.
+bumpStat :: StatName -> Int -> IO ()
+bumpStat name n =
+  atomicModifyIORef' statsTable $ \m -> (M.insertWith (+) name n m, ())
+
+-- | Overwrite a gauge, such as a queue depth.
+setStat :: StatName -> Int -> IO ()
+setStat name n =
+  atomicModifyIORef' statsTable $ \m -> (M.insert name n m, ())
+
+statsSnapshot :: IO [(StatName, Int)]
+statsSnapshot = do
+  named <- readIORef statsTable
+  ops   <- mapM (\op -> (,) (labelOpName op) <$> labelOpCount op) [minBound .. maxBound]
+  let ratios = [ (name, 100 * num `div` den)
+               | (name, numName, denName) <- ratioStats
+               , Just num <- [M.lookup numName named]
+               , Just den <- [M.lookup denName named], den > 0 ]
+  return $ M.toList $ M.unions [named, M.fromList (filter ((/= 0) . snd) ops), M.fromList ratios]
+
+-- | Percentages computed from two counters when a snapshot is taken.
+ratioStats :: [(StatName, StatName, StatName)]
+ratioStats = [("compress.ratio_pct", "compress.bytes_out", "compress.bytes_in")]
+
+printStats :: IO ()
+printStats = do
+  stats <- statsSnapshot
+  mapM_ (\(name, v) -> putStrLn $ name <> " = " <> show v) stats
+  hFlush stdout -- Gramine prints only if stdout is flushed
+
+
+{-@ Label operations run several times per request, too often for the
+    map above. They are counted in a flat array instead, with a plain
+    load and store and no allocation: exact on one thread, an
+    undercount when threads race. They show up in `statsSnapshot` as
+    "label.<op>".
+@-}
+
+data LabelOp = OpLabel     -- ^ label, labelP
+             | OpUnlabel   -- ^ unlabel, unlabelP
+             | OpTaint     -- ^ taint, taintP
+             | OpGuard     -- ^ guardAlloc, guardAllocP
+             | OpToLabeled -- ^ toLabeled, toLabeledP
+             deriving (Eq, Show, Enum, Bounded)
+
+labelOpName :: LabelOp -> StatName
+labelOpName op = case op of
+  OpLabel     -> "label.label"
+  OpUnlabel   -> "label.unlabel"
+  OpTaint     -> "label.taint"
+  OpGuard     -> "label.guard"
+  OpToLabeled -> "label.to_labeled"
+
+labelOpTable :: Ptr Int
+labelOpTable = unsafePerformIO $ callocArray (fromEnum (maxBound :: LabelOp) + 1)
+{-# NOINLINE labelOpTable #-}
+
+countLabelOp :: LabelOp -> IO ()
+countLabelOp op = do
+  n <- peekElemOff labelOpTable (fromEnum op)
+  pokeElemOff labelOpTable (fromEnum op) (n + 1)
+
+labelOpCount :: LabelOp -> IO Int
+labelOpCount op = peekElemOff labelOpTable (fromEnum op)
+
+resetLabelOps :: IO ()
+resetLabelOps = mapM_ (\op -> pokeElemOff labelOpTable (fromEnum op) 0) [minBound .. maxBound :: LabelOp]
@@ -0,0 +1,169 @@
+{-# LANGUAGE ScopedTypeVariables #-}
+
+module Main (main) where
+
+import Control.Exception (evaluate)
+import Control.Monad (forM, replicateM_, unless)
+import Control.Monad.Trans.State.Strict (runStateT)
+import Data.Array ((!))
+import Data.Binary
+import Data.Maybe (fromMaybe)
+import GHC.Conc (getAllocationCounter)
+import System.Exit (exitFailure)
+import Text.Printf (printf)
+
+import qualified Data.ByteString.Lazy as BL
+
+import App
+import DCLabel
+import Enclave
+import Stats
+
+{-@ Performance budgets
+
+    Every scenario runs a representative enclave program `perfRuns`
+    times on this thread and compares, per run, the bytes allocated
+    (the thread's allocation counter) and the label operations counted
+    in `Stats` against the budgets in `budgets` below. Any scenario over
+    budget fails the suite.
+
+    Label operation counts are exact, so their budgets are tight; a new
+    `taint` on a hot path shows up as a failure. Allocation budgets have
+    headroom for GHC versions; when a change lowers allocation for good,
+    lower the budget with it. Run with
+
+      cabal test EnclaveIFC-perf --test-show-details=direct
+
+@-}
+
+perfRuns :: Int
+perfRuns = 2000
+
+data Budget = Budget { budgetAlloc :: Int -- ^ bytes per run
+                     , budgetOps   :: [(LabelOp, Int)] -- ^ per run, others 0
+                     }
+
+budgets :: [(String, Budget)]
+budgets =
+  [ ("unlabel",        Budget   4096 [(OpUnlabel, 1), (OpTaint, 1)])
+  , ("toLabeled x8",   Budget  65536 [ (OpToLabeled, 8), (OpLabel, 8), (OpGuard, 8)
+                                     , (OpUnlabel, 9), (OpTaint, 9)])
+  , ("pwd dispatch",   Budget  16384 [(OpUnlabel, 1), (OpTaint, 1)])
+  , ("sendData",       Budget  32768 [(OpTaint, 1), (OpGuard, 1)])
+  , ("runQuery x100",  Budget 524288 [(OpUnlabel, 100), (OpTaint, 101)])
+  ]
+
+-- | The `app/Main.hs` schema, flattened
+data Row = Row Word8 Word8 deriving (Show, Eq)
+
+instance Binary Row where
+  put (Row var age) = put var >> put age
+  get = Row <$> get <*> get
+
+top :: DCLabel
+top = False %% True
+
+-- | Clearance and output channel at the top, so results may leave.
+openState :: LIOState DCLabel CNF
+openState = LIOState { lioLabel     = dcPublic
+                     , lioClearance = top
+                     , lioOutLabel  = top
+                     , lioPrivilege = PrivTCB cTrue
+                     }
+
+orgLabel :: String -> DCLabel
+orgLabel org = org %% org
+
+-- | The method table, as the enclave would see it.
+methods :: App a -> IO MethodTable
+methods (App s) = (\(_, (_, remotes, _)) -> freezeMethods remotes)
+                    <$> runStateT s (initAppState "perf")
+
+-- | A request carrying the signature the method was registered with.
+request :: MethodTable -> Identifier -> CallID -> [BL.ByteString] -> Request
+request vTable caller identifier = Request caller identifier (entrySig (vTable ! identifier))
+
+dispatched :: MethodTable -> Request -> IO ()
+dispatched vTable req = do
+  (st, res) <- dispatch vTable req
+  unless (st == Served) $ ioError (userError ("not served: " <> show st))
+  _ <- evaluate (maybe 0 BL.length res)
+  return ()
+
+run :: EnclaveDC a -> IO ()
+run m = runLIO m openState >>= \(a, _) -> a `seq` return ()
+
+scenario :: String -> IO (IO ())
+scenario name = case name of
+  "unlabel" -> do
+    let lv = LabeledTCB (orgLabel "org1") (Row 1 40)
+    return $ run (unlabel lv)
+
+  "toLabeled x8" -> do
+    let lv = LabeledTCB (orgLabel "org1") (Row 1 40)
+        nest :: Int -> EnclaveDC Row -> EnclaveDC Row
+        nest 0 m = m
+        nest d m = toLabeled top (nest (d - 1) m) >>= unlabel
+    return $ run (nest 8 (unlabel lv))
+
+  "pwd dispatch" -> do
+    vTable <- methods $ do
+      pwd <- inEnclaveLabeledConstant ("Alice" %% "Alice") "password"
+      inEnclave (dcDefaultState (toCNF "Alice")) $ \(guess :: String) -> do
+        l_pwd <- pwd
+        priv  <- getPrivilege
+        p     <- unlabelP priv l_pwd
+        return (p == guess)
+    return $ dispatched vTable (request vTable "client" 0 [encode "password"])
+
+  "sendData" -> do
+    vTable <- methods $ do
+      db <- liftNewRef dcPublic ([] :: [DCLabeled Row])
+      inEnclave openState $ \(lrow :: DCLabeled Row) -> do
+        ref <- db
+        modifyRef ref (lrow :)
+    let lrow = LabeledTCB (orgLabel "org1") (Row 1 40) :: DCLabeled Row
+    return $ dispatched vTable (request vTable "org1" 0 [encode lrow])
+
+  "runQuery x100" -> do
+    let rows = [ LabeledTCB (orgLabel (if even i then "org1" else "org2"))
+                            (Row (fromIntegral (i `mod` 6)) (fromIntegral (20 + i)))
+               | i <- [0 .. 99 :: Int] ] :: [DCLabeled Row]
+    vTable <- methods $ do
+      db <- liftNewRef dcPublic rows
+      inEnclave openState $ do
+        ref <- db
+        rs  <- readRef ref >>= mapM unlabel
+        return (sum [fromIntegral age :: Int | Row _ age <- rs])
+    return $ dispatched vTable (request vTable "org3" 0 [])
+
+  _ -> ioError (userError ("no scenario " <> name))
+
+-- | Per run: bytes allocated and label operations.
+measure :: IO () -> IO (Int, [(LabelOp, Int)])
+measure act = do
+  act -- warm up: CAFs, first use of the stats table
+  resetLabelOps
+  before <- getAllocationCounter -- counts down
+  replicateM_ perfRuns act
+  after  <- getAllocationCounter
+  ops    <- forM [minBound .. maxBound] $ \op -> (,) op <$> labelOpCount op
+  return ( fromIntegral (before - after) `div` perfRuns
+         , [(op, n `div` perfRuns) | (op, n) <- ops] )
+
+check :: (String, Budget) -> IO Bool
+check (name, Budget alloc opBudget) = do
+  (bytes, ops) <- scenario name >>= measure
+  let overOps = [ (op, n, b) | (op, n) <- ops
+                             , let b = fromMaybe 0 (lookup op opBudget), n > b ]
+      ok      = bytes <= alloc && null overOps
+  printf "%-16s %8d / %8d bytes  %s  %s\n" name bytes alloc
+         (unwords [ labelOpName op <> "=" <> show n | (op, n) <- ops, n > 0 ])
+         (if ok then "ok" else "OVER BUDGET")
+  mapM_ (\(op, n, b) -> printf "  %s: %d > %d\n" (labelOpName op) n b) overOps
+  return ok
+
+main :: IO ()
+main = do
+  results <- mapM check budgets
+  unless (and results) exitFailure